@@ -4,4 +4,10 @@
 #define WIFI_SSID "your_wifi_name"
 #define WIFI_PASSWORD "your_wifi_password"
 
+// optional, skips DHCP for a faster connect after boot
+// #define WIFI_STATIC_IP "192.168.1.50"
+// #define WIFI_GATEWAY "192.168.1.1"
+// #define WIFI_SUBNET "255.255.255.0"
+// #define WIFI_DNS "192.168.1.1"
+
 #endif
\ No newline at end of file
@@ -1,12 +1,25 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include "Logger.h"
+
+// everything goes through the log ring, nothing blocks on serial at the call
+// site. debug messages are compiled out of release builds, the rest stay so
+// /logs has something to show
 #ifdef DEBUG_BUILD
-#define DEBUG_PRINT(x) Serial.println(x)
-#define DEBUG_PRINTF(format, ...) Serial.printf(format, ##__VA_ARGS__)
+#define DEBUG_PRINT(x) DEBUG_PRINTF("%s\n", x)
+#define DEBUG_PRINTF(format, ...)                                              \
+  LOGGER_PRINTF(LEVEL_DEBUG, format, ##__VA_ARGS__)
 #else
 #define DEBUG_PRINT(x)
 #define DEBUG_PRINTF(x, ...)
 #endif
 
-#endif // DEBUG_H
\ No newline at end of file
+#define INFO_PRINTF(format, ...)                                               \
+  LOGGER_PRINTF(LEVEL_INFO, format, ##__VA_ARGS__)
+#define WARN_PRINTF(format, ...)                                               \
+  LOGGER_PRINTF(LEVEL_WARN, format, ##__VA_ARGS__)
+#define ERROR_PRINTF(format, ...)                                              \
+  LOGGER_PRINTF(LEVEL_ERROR, format, ##__VA_ARGS__)
+
+#endif // DEBUG_H
@@ -0,0 +1,5 @@
+Import("env")
+
+# build_flags only reach the compiler, the sanitizer runtimes have to be
+# linked in as well
+env.Append(LINKFLAGS=["-fsanitize=address,undefined"])
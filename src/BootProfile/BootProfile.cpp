@@ -0,0 +1,59 @@
+#include "BootProfile.h"
+#include "debug.h"
+#include <esp_system.h>
+#include <esp_timer.h>
+
+BootProfile *BootProfile::instance = nullptr;
+
+void BootProfile::mark(BootPhase phase) {
+  // esp_timer starts with the app, it's never 0 by the time we get here
+  uint32_t now = (uint32_t)esp_timer_get_time();
+  uint32_t expected = 0;
+
+  if (phaseTimes[phase].compare_exchange_strong(expected, now)) {
+    DEBUG_PRINTF("Boot: %s at %lums\n", getPhaseName(phase),
+                 (unsigned long)(now / 1000));
+  }
+}
+
+const char *BootProfile::getPhaseName(BootPhase phase) {
+  switch (phase) {
+  case BOOT_SETUP:
+    return "setup";
+  case BOOT_BREW_READY:
+    return "brewReady";
+  case BOOT_BLE_READY:
+    return "bleReady";
+  case BOOT_WEB_READY:
+    return "webReady";
+  case BOOT_WIFI_CONNECTED:
+    return "wifiConnected";
+  case BOOT_SCALE_CONNECTED:
+    return "scaleConnected";
+  default:
+    return "unknown";
+  }
+}
+
+const char *BootProfile::getResetReasonName() {
+  switch (esp_reset_reason()) {
+  case ESP_RST_POWERON:
+    return "powerOn";
+  case ESP_RST_EXT:
+    return "external";
+  case ESP_RST_SW:
+    return "software";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+  case ESP_RST_TASK_WDT:
+  case ESP_RST_WDT:
+    return "watchdog";
+  case ESP_RST_DEEPSLEEP:
+    return "deepSleep";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  default:
+    return "unknown";
+  }
+}
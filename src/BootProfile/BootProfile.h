@@ -0,0 +1,53 @@
+#ifndef BOOT_PROFILE_H
+#define BOOT_PROFILE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// in the order they usually happen, the network and the scale come up in the
+// background so those two can land either way round
+enum BootPhase : uint8_t {
+  BOOT_SETUP,           // setup() entered
+  BOOT_BREW_READY,      // buttons and relay live, a shot can be started
+  BOOT_BLE_READY,       // bluetooth stack up
+  BOOT_WEB_READY,       // web server listening, wifi still connecting
+  BOOT_WIFI_CONNECTED,  // got an IP
+  BOOT_SCALE_CONNECTED, // first scale connection
+  BOOT_PHASE_COUNT
+};
+
+/**
+ * Timestamps for each phase of the boot, so we can see where the time goes
+ * between a power blip or OTA and being able to brew again.
+ */
+class BootProfile {
+public:
+  static BootProfile *getInstance() {
+    if (instance == nullptr) {
+      instance = new BootProfile();
+    }
+    return instance;
+  }
+
+  // only the first time counts, reconnects later on aren't part of the boot
+  void mark(BootPhase phase);
+
+  // us since the app started, 0 if the phase hasn't happened yet
+  uint32_t getPhaseTime(BootPhase phase) const {
+    return phaseTimes[phase].load();
+  }
+
+  static const char *getPhaseName(BootPhase phase);
+  static const char *getResetReasonName();
+
+private:
+  BootProfile() {}
+  BootProfile(const BootProfile &) = delete;
+  BootProfile &operator=(const BootProfile &) = delete;
+
+  static BootProfile *instance;
+
+  std::atomic<uint32_t> phaseTimes[BOOT_PHASE_COUNT] = {};
+};
+
+#endif
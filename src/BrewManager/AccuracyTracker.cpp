@@ -0,0 +1,131 @@
+#include "AccuracyTracker.h"
+#include <cmath>
+
+void P2Quantile::reset(float quantile) {
+  p = quantile;
+  count = 0;
+
+  for (int i = 0; i < 5; i++) {
+    heights[i] = 0.0f;
+    positions[i] = i + 1;
+  }
+
+  desired[0] = 1;
+  desired[1] = 1 + 2 * p;
+  desired[2] = 1 + 4 * p;
+  desired[3] = 3 + 2 * p;
+  desired[4] = 5;
+
+  increments[0] = 0;
+  increments[1] = p / 2;
+  increments[2] = p;
+  increments[3] = (1 + p) / 2;
+  increments[4] = 1;
+}
+
+void P2Quantile::add(float x) {
+  // first five samples are kept sorted as the initial markers
+  if (count < 5) {
+    int i = count++;
+    while (i > 0 && heights[i - 1] > x) {
+      heights[i] = heights[i - 1];
+      i--;
+    }
+    heights[i] = x;
+    return;
+  }
+
+  count++;
+
+  int k;
+  if (x < heights[0]) {
+    heights[0] = x;
+    k = 0;
+  } else if (x >= heights[4]) {
+    heights[4] = x;
+    k = 3;
+  } else {
+    k = 0;
+    while (k < 3 && x >= heights[k + 1])
+      k++;
+  }
+
+  for (int i = k + 1; i < 5; i++)
+    positions[i] += 1;
+  for (int i = 0; i < 5; i++)
+    desired[i] += increments[i];
+
+  // move the middle markers towards where they should be
+  for (int i = 1; i < 4; i++) {
+    float d = desired[i] - positions[i];
+    if ((d >= 1 && positions[i + 1] - positions[i] > 1) ||
+        (d <= -1 && positions[i - 1] - positions[i] < -1)) {
+      int step = d > 0 ? 1 : -1;
+      float h = parabolic(i, step);
+      if (heights[i - 1] < h && h < heights[i + 1]) {
+        heights[i] = h;
+      } else {
+        heights[i] = linear(i, step);
+      }
+      positions[i] += step;
+    }
+  }
+}
+
+float P2Quantile::parabolic(int i, float d) const {
+  return heights[i] +
+         d / (positions[i + 1] - positions[i - 1]) *
+             ((positions[i] - positions[i - 1] + d) *
+                  (heights[i + 1] - heights[i]) /
+                  (positions[i + 1] - positions[i]) +
+              (positions[i + 1] - positions[i] - d) *
+                  (heights[i] - heights[i - 1]) /
+                  (positions[i] - positions[i - 1]));
+}
+
+float P2Quantile::linear(int i, int d) const {
+  return heights[i] + d * (heights[i + d] - heights[i]) /
+                          (positions[i + d] - positions[i]);
+}
+
+float P2Quantile::get() const {
+  if (count == 0)
+    return 0.0f;
+
+  // not enough for the markers yet, just read it off the sorted samples
+  if (count <= 5) {
+    int index = (int)roundf(p * (count - 1));
+    return heights[index];
+  }
+
+  return heights[2];
+}
+
+void AccuracyTracker::reset() {
+  count = 0;
+  mean = 0.0f;
+  m2 = 0.0f;
+  ewma = 0.0f;
+
+  quantiles[0].reset(0.5f);
+  quantiles[1].reset(0.9f);
+  quantiles[2].reset(0.99f);
+}
+
+void AccuracyTracker::add(float error) {
+  count++;
+
+  float delta = error - mean;
+  mean += delta / count;
+  m2 += delta * (error - mean);
+
+  ewma = (count == 1) ? error : ewma + EWMA_ALPHA * (error - ewma);
+
+  for (int i = 0; i < QUANTILE_COUNT; i++) {
+    quantiles[i].add(fabsf(error));
+  }
+}
+
+float AccuracyTracker::getStdDev() const {
+  return count > 1 ? sqrtf(m2 / (count - 1)) : 0.0f;
+}
@@ -0,0 +1,60 @@
+#ifndef ACCURACY_TRACKER_H
+#define ACCURACY_TRACKER_H
+
+#include <Arduino.h>
+
+/**
+ * P-square streaming quantile estimate (Jain & Chlamtac). Five markers
+ * whose heights are nudged with a parabolic fit as samples arrive, so it
+ * tracks the quantile in constant memory without keeping the samples.
+ */
+struct P2Quantile {
+  float p;
+  uint32_t count;
+  float heights[5];
+  float positions[5];
+  float desired[5];
+  float increments[5];
+
+  void reset(float quantile);
+  void add(float x);
+  float get() const;
+
+private:
+  float parabolic(int i, float d) const;
+  float linear(int i, int d) const;
+};
+
+/**
+ * Stop accuracy across shots, error = final weight - target weight.
+ * Welford mean/variance, an EWMA for the recent trend and P-square
+ * estimates of the absolute error percentiles. Plain data so it can be
+ * stored in NVS as is.
+ */
+class AccuracyTracker {
+public:
+  static constexpr int QUANTILE_COUNT = 3;
+
+  void reset();
+  void add(float error);
+
+  uint32_t getCount() const { return count; }
+  float getMean() const { return mean; }
+  float getStdDev() const;
+  float getEwma() const { return ewma; }
+  // p50/p90/p99 of the absolute error
+  float getQuantile(int index) const { return quantiles[index].get(); }
+  float getQuantileLevel(int index) const { return quantiles[index].p; }
+
+private:
+  // roughly the last 10 shots
+  static constexpr float EWMA_ALPHA = 0.2f;
+
+  uint32_t count;
+  float mean;
+  float m2;
+  float ewma;
+  P2Quantile quantiles[QUANTILE_COUNT];
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include "BrewEventLog.h"
+#include <esp_timer.h>
+
+void BrewEventLog::add(BrewEventType type, uint8_t value,
+                       BrewEventCause cause, int64_t timeUs) {
+  if (timeUs == 0)
+    timeUs = esp_timer_get_time();
+
+  portENTER_CRITICAL(&mux);
+  BrewEvent &event = events[count % CAPACITY];
+  event.timeUs = timeUs;
+  event.shot = currentShot;
+  event.type = type;
+  event.value = value;
+  event.cause = cause;
+  count++;
+  portEXIT_CRITICAL(&mux);
+}
+
+uint16_t BrewEventLog::beginShot(int64_t triggerUs) {
+  portENTER_CRITICAL(&mux);
+  uint16_t previous = currentShot;
+  currentShot++;
+
+  // only ever the last few entries, stop at the first one that's too old
+  for (uint32_t i = count; i > 0 && count - i < CAPACITY; i--) {
+    BrewEvent &event = events[(i - 1) % CAPACITY];
+    if (event.shot != previous || event.timeUs < triggerUs)
+      break;
+    event.shot = currentShot;
+  }
+
+  uint16_t shot = currentShot;
+  portEXIT_CRITICAL(&mux);
+  return shot;
+}
+
+size_t BrewEventLog::getShotEvents(uint16_t shot, BrewEvent *out,
+                                   size_t maxEvents) {
+  size_t found = 0;
+
+  portENTER_CRITICAL(&mux);
+  uint32_t first = count > CAPACITY ? count - CAPACITY : 0;
+  for (uint32_t i = first; i < count && found < maxEvents; i++) {
+    const BrewEvent &event = events[i % CAPACITY];
+    if (event.shot == shot)
+      out[found++] = event;
+  }
+  portEXIT_CRITICAL(&mux);
+
+  // buttons are logged once debounced but stamped with the edge, so the
+  // ring isn't quite in time order. insertion sort, it nearly is
+  for (size_t i = 1; i < found; i++) {
+    BrewEvent event = out[i];
+    size_t j = i;
+    while (j > 0 && out[j - 1].timeUs > event.timeUs) {
+      out[j] = out[j - 1];
+      j--;
+    }
+    out[j] = event;
+  }
+
+  return found;
+}
+
+const char *BrewEventLog::getTypeName(uint8_t type) {
+  switch (type) {
+  case BREW_EVENT_STATE:
+    return "state";
+  case BREW_EVENT_BUTTON:
+    return "button";
+  case BREW_EVENT_RELAY_REQUEST:
+    return "relayRequest";
+  case BREW_EVENT_RELAY_EDGE:
+    return "relayEdge";
+  case BREW_EVENT_MACRO_DONE:
+    return "macroDone";
+  case BREW_EVENT_RELAY_DROPPED:
+    return "relayDropped";
+  default:
+    return "unknown";
+  }
+}
+
+const char *BrewEventLog::getCauseName(uint8_t cause) {
+  switch (cause) {
+  case CAUSE_NONE:
+    return "none";
+  case CAUSE_BUTTON:
+    return "button";
+  case CAUSE_API:
+    return "api";
+  case CAUSE_PROJECTION:
+    return "projection";
+  case CAUSE_FAILSAFE:
+    return "failsafe";
+  case CAUSE_EARLY_STOP:
+    return "earlyStop";
+  case CAUSE_ONSET:
+    return "onset";
+  case CAUSE_SETTLED:
+    return "settled";
+  case CAUSE_TIMEOUT:
+    return "timeout";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef BREW_EVENT_LOG_H
+#define BREW_EVENT_LOG_H
+
+#include <Arduino.h>
+
+enum BrewEventType : uint8_t {
+  BREW_EVENT_STATE,         // value = new BrewState
+  BREW_EVENT_BUTTON,        // value = ButtonId << 1 | pressed
+  BREW_EVENT_RELAY_REQUEST, // value = RelaySequence that was asked for
+  BREW_EVENT_RELAY_EDGE,    // value = relay level when it actually switched
+  BREW_EVENT_MACRO_DONE,
+  BREW_EVENT_RELAY_DROPPED, // value = RelaySequence refused during a stop
+  BREW_EVENT_TYPE_COUNT
+};
+
+// why a state changed
+enum BrewEventCause : uint8_t {
+  CAUSE_NONE,
+  CAUSE_BUTTON,
+  CAUSE_API,
+  CAUSE_PROJECTION, // projected final weight reached the target
+  CAUSE_FAILSAFE,   // max shot time, lost scale or the no-scale time guard
+  CAUSE_EARLY_STOP, // drips went flat
+  CAUSE_ONSET,      // first drips ended preinfusion
+  CAUSE_SETTLED,    // drip model converged
+  CAUSE_TIMEOUT,    // gave up waiting for the drips
+  CAUSE_COUNT
+};
+
+struct BrewEvent {
+  int64_t timeUs; // esp_timer_get_time()
+  uint16_t shot;
+  uint8_t type;
+  uint8_t value;
+  uint8_t cause;
+};
+
+/**
+ * Fixed size ring of everything that happens around a shot: state changes
+ * with their cause, button edges, relay requests and the relay edges as the
+ * timer actually fired them. All stamped in us so end to end latencies can be
+ * read straight off it, e.g. button edge -> relay edge or projection crossing
+ * -> relay edge.
+ *
+ * Events are tagged with the shot they belong to. A shot is usually started
+ * by something that was logged before it (the button press), so beginShot()
+ * pulls the events since the trigger into the new shot.
+ */
+class BrewEventLog {
+public:
+  static constexpr size_t CAPACITY = 128;
+
+  // called from the loop and the relay timer task
+  void add(BrewEventType type, uint8_t value,
+           BrewEventCause cause = CAUSE_NONE, int64_t timeUs = 0);
+
+  uint16_t beginShot(int64_t triggerUs);
+  uint16_t getCurrentShot() const { return currentShot; }
+
+  // copies the shot's events that are still in the ring, oldest first
+  size_t getShotEvents(uint16_t shot, BrewEvent *out, size_t maxEvents);
+
+  static const char *getTypeName(uint8_t type);
+  static const char *getCauseName(uint8_t cause);
+
+private:
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  BrewEvent events[CAPACITY] = {};
+  uint32_t count = 0;
+  uint16_t currentShot = 0;
+};
+
+#endif
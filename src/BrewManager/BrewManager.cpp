@@ -8,8 +8,10 @@
 BrewManager *BrewManager::instance = nullptr;
 
 void BrewManager::begin() {
-  machine.begin();
+  machine.begin(&events);
   sManager = ScaleManager::getInstance();
+  pManager = PowerManager::getInstance();
+  scheduler = Scheduler::getInstance();
 }
 
 void BrewManager::saveSettings() {
@@ -25,6 +27,8 @@ void BrewManager::saveSettings() {
   preferences.putInt("pmode", (int)prefs.pMode);
   preferences.putFloat("lr", prefs.learningRate);
   preferences.putFloat("lag", prefs.systemLag);
+  preferences.putFloat("act0", actuationDelay[STOP_CLICK]);
+  preferences.putFloat("act1", actuationDelay[STOP_FROM_PREINFUSION]);
 
   preferences.putFloat("bias0", flowCompBias[0]);
   preferences.putFloat("bias1", flowCompBias[1]);
@@ -35,6 +39,14 @@ void BrewManager::saveSettings() {
   preferences.putBytes("histP1", recentShotsProfile1,
                        sizeof(recentShotsProfile1));
 
+  preferences.putBytes("histV0", shotVersions[0], sizeof(shotVersions[0]));
+  preferences.putBytes("histV1", shotVersions[1], sizeof(shotVersions[1]));
+  preferences.putUInt("ver", stateVersion);
+  preferences.putUInt("resetVer", resetVersion);
+
+  preferences.putBytes("acc0", &accuracy[0], sizeof(AccuracyTracker));
+  preferences.putBytes("acc1", &accuracy[1], sizeof(AccuracyTracker));
+
   preferences.putString("apiUrl", prefs.apiUrl);
   preferences.putString("apiToken", prefs.apiToken);
   preferences.putBool("autoSave", prefs.autoSavePreset);
@@ -48,7 +60,8 @@ void BrewManager::loadSettings() {
 
   prefs.isEnabled = preferences.getBool("enabled", true);
   prefs.regularPreset = preferences.getFloat("reg", 40.0f);
-  prefs.timezone = preferences.getString("tz", "GMT0");
+  if (!preferences.getString("tz", prefs.timezone, sizeof(prefs.timezone)))
+    strlcpy(prefs.timezone, "GMT0", sizeof(prefs.timezone));
   prefs.decafPreset = preferences.getFloat("dec", 40.0f);
   prefs.decafStartHour = preferences.getInt("decHr", -1);
   prefs.pMode = PreinfusionMode(preferences.getInt("pmode", 0));
@@ -59,6 +72,10 @@ void BrewManager::loadSettings() {
   float lag = preferences.getFloat("lag", 0.8f);
   prefs.systemLag = constrain(lag, 0.0f, 2.0f);
 
+  // 0 until measured, the system lag covers it until then
+  actuationDelay[STOP_CLICK] = preferences.getFloat("act0", 0.0f);
+  actuationDelay[STOP_FROM_PREINFUSION] = preferences.getFloat("act1", 0.0f);
+
   flowCompBias[0] = preferences.getFloat("bias0", 1.0f);
   flowCompBias[1] = preferences.getFloat("bias1", 1.0f);
 
@@ -78,65 +95,136 @@ void BrewManager::loadSettings() {
     memset(recentShotsProfile1, 0, expectedSize);
   }
 
-  prefs.apiUrl = preferences.getString("apiUrl", "");
-  prefs.apiToken = preferences.getString("apiToken", "");
+  const char *versionKeys[2] = {"histV0", "histV1"};
+  for (int i = 0; i < 2; i++) {
+    if (preferences.getBytesLength(versionKeys[i]) == sizeof(shotVersions[i]))
+      preferences.getBytes(versionKeys[i], shotVersions[i],
+                           sizeof(shotVersions[i]));
+    else
+      memset(shotVersions[i], 0, sizeof(shotVersions[i]));
+  }
+  stateVersion = preferences.getUInt("ver", 1);
+  resetVersion = preferences.getUInt("resetVer", 0);
+
+  const char *accuracyKeys[2] = {"acc0", "acc1"};
+  for (int i = 0; i < 2; i++) {
+    if (preferences.getBytesLength(accuracyKeys[i]) ==
+        sizeof(AccuracyTracker)) {
+      preferences.getBytes(accuracyKeys[i], &accuracy[i],
+                           sizeof(AccuracyTracker));
+    } else {
+      accuracy[i].reset();
+    }
+  }
+
+  if (!preferences.getString("apiUrl", prefs.apiUrl, sizeof(prefs.apiUrl)))
+    prefs.apiUrl[0] = '\0';
+  if (!preferences.getString("apiToken", prefs.apiToken,
+                             sizeof(prefs.apiToken)))
+    prefs.apiToken[0] = '\0';
   prefs.autoSavePreset = preferences.getBool("autoSave", false);
   prefs.earlyStop = preferences.getBool("earlyStop", false);
 
   preferences.end();
 }
 
-void BrewManager::setPrefs(BrewPrefs newPrefs) {
+void BrewManager::setPrefs(const BrewPrefs &newPrefs) {
   prefs = newPrefs;
 
   prefs.learningRate = constrain(prefs.learningRate, 0.0f, 1.0f);
   prefs.systemLag = constrain(prefs.systemLag, 0.0f, 2.0f);
 
+  bumpStateVersion();
   saveSettings();
 
   syncTimezone();
-}
 
-BrewPrefs BrewManager::getPrefs() { return prefs; }
+  Scheduler::getInstance()->notify(EVENT_COMMAND);
+}
 
 void BrewManager::clearShotData() {
   flowCompBias[0] = 1.0f;
   flowCompBias[1] = 1.0f;
 
+  setActuationDelay(STOP_CLICK, 0.0f);
+  setActuationDelay(STOP_FROM_PREINFUSION, 0.0f);
+
   memset(recentShotsProfile0, 0, sizeof(recentShotsProfile0));
   memset(recentShotsProfile1, 0, sizeof(recentShotsProfile1));
+  memset(shotVersions, 0, sizeof(shotVersions));
 
+  accuracy[0].reset();
+  accuracy[1].reset();
+
+  resetVersion = stateVersion + 1;
+  bumpStateVersion();
   saveSettings();
 }
 
+void BrewManager::setActuationDelay(StopPath path, float delay) {
+  // the system lag was fitted on the whole drippage, so it's been covering
+  // whatever the actuation delay doesn't yet. move the difference over or the
+  // projection counts it twice until the flow model catches up
+  prefs.systemLag =
+      constrain(prefs.systemLag - (delay - actuationDelay[path]), 0.0f, 2.0f);
+  actuationDelay[path] = delay;
+}
+
 void BrewManager::finalizeBrew() {
   globalShotCounter++;
 
-  float error = (currentWeight - targetWeight) / targetWeight;
+  shotSummary = shotStats.finalize(brewEndTime);
+
+  float error = (finalWeight - targetWeight) / targetWeight;
+
+  // a shot finished by prediction, or one where we had to guess what went
+  // into the cup before the scale connected, only has a guessed final
+  // weight. keep it out of the history and the flow model
+  bool trusted = !scaleLost && !blindStop && weightSeed == 0.0f;
+
+  uint32_t spikes = getShotSpikes();
+  if (spikes > 0) {
+    DEBUG_PRINTF("%lu spikes filtered during the shot\n",
+                 (unsigned long)spikes);
+  }
+  if (spikes > MAX_SHOT_SPIKES)
+    trusted = false;
+
+  // the stop itself doesn't care how the shot ended up, learn it even if the
+  // final weight is off
+  if (trusted && actuationMeasured) {
+    float measured = measuredActuationDelay / 1000.0f;
+    float learned =
+        actuationDelay[stopPath] * (1.0f - ACTUATION_LEARNING_RATE) +
+        measured * ACTUATION_LEARNING_RATE;
+    setActuationDelay(stopPath, learned);
+    DEBUG_PRINTF("Actuation delay %lums, learned %.3fs\n",
+                 (unsigned long)measuredActuationDelay,
+                 actuationDelay[stopPath]);
+  }
+
+  // every shot with a measured final weight counts towards accuracy, even
+  // the ones we don't learn from
+  if (!scaleLost && weightSeed == 0.0f) {
+    accuracy[currentProfileIndex].add(finalWeight - targetWeight);
+  }
 
   /*
    * in these cases we assume the user has accidentally raised the cup before
    * end of brew or accidentally touched the scale and thus we can exclude it
    * from flow comp calculation and shot history
    */
-  if (abs(error) > 0.15)
+  if (trusted && abs(error) > 0.15) {
+    // the learned delay and accuracy still moved. save here too so the
+    // version that's gone out is never ahead of the saved one
+    bumpStateVersion();
+    saveSettings();
     return;
-
-  Shot *recentShots =
-      (currentProfileIndex == 0) ? recentShotsProfile0 : recentShotsProfile1;
-
-  for (int i = MAX_HISTORY - 1; i > 0; i--) {
-    recentShots[i] = recentShots[i - 1];
   }
 
-  // Add newest shot at index 0
-  recentShots[0] = {.id = globalShotCounter,
-                    .targetWeight = targetWeight,
-                    .finalWeight = currentWeight,
-                    .lastFlowRate = lastFlowRate,
-                    .stopWeight = stopWeight};
-
-  updateFlowModel();
+  if (trusted) {
+    recordShot();
+  }
 
   if (prefs.autoSavePreset) {
     if (isDecafTime()) {
@@ -146,13 +234,50 @@ void BrewManager::finalizeBrew() {
     }
   }
 
+  // only once everything's changed, so nobody gets the new version with the
+  // old data
+  bumpStateVersion();
   saveSettings();
-  pendingBeeps = 3;
+
+  // 3 beeps for a finished shot, 4 if it was logged to bru as well
+  int beeps = 3;
 
   WebAPI *webApi = WebAPI::getInstance();
   if (webApi && webApi->getWebSocketClientCount() == 0) {
-    sendAutoBrewLog();
+    if (sendAutoBrewLog())
+      beeps = 4;
   }
+
+  sManager->beep(beeps);
+}
+
+void BrewManager::recordShot() {
+  Shot *recentShots =
+      (currentProfileIndex == 0) ? recentShotsProfile0 : recentShotsProfile1;
+
+  uint32_t *versions = shotVersions[currentProfileIndex];
+
+  for (int i = MAX_HISTORY - 1; i > 0; i--) {
+    recentShots[i] = recentShots[i - 1];
+    versions[i] = versions[i - 1];
+  }
+  // the version finalizeBrew is about to publish
+  versions[0] = stateVersion + 1;
+
+  // Add newest shot at index 0
+  recentShots[0] = {.id = globalShotCounter,
+                    .targetWeight = targetWeight,
+                    .finalWeight = finalWeight,
+                    .lastFlowRate = lastFlowRate,
+                    .stopWeight = stopWeight,
+                    .firstDripTime = firstDripTime,
+                    .actuationDelay =
+                        actuationMeasured
+                            ? measuredActuationDelay
+                            : (uint32_t)(actuationDelay[stopPath] * 1000.0f),
+                    .summary = shotSummary};
+
+  updateFlowModel();
 }
 
 void BrewManager::updateFlowModel() {
@@ -170,7 +295,11 @@ void BrewManager::updateFlowModel() {
   for (int i = 0; i < MAX_HISTORY; i++) {
     if (history[i].id == 0 || history[i].lastFlowRate < 0.2f) continue;
     
-    float actualDrip = history[i].finalWeight - history[i].stopWeight;
+    // the flow carries on at full rate until the machine reacts, that part is
+    // the actuation delay's and not the drip model's
+    float actualDrip = history[i].finalWeight - history[i].stopWeight -
+                       history[i].lastFlowRate *
+                           (history[i].actuationDelay / 1000.0f);
     float predictedDrip = (history[i].lastFlowRate * prefs.systemLag) + flowCompBias[currentProfileIndex];
     
     residuals[validCount++] = actualDrip - predictedDrip;
@@ -199,7 +328,9 @@ void BrewManager::updateFlowModel() {
   for (int i = 0; i < MAX_HISTORY; i++) {
     if (history[i].id == 0 || history[i].lastFlowRate < 0.2f) continue;
 
-    float y = history[i].finalWeight - history[i].stopWeight; // Total Drippage
+    float y = history[i].finalWeight - history[i].stopWeight -
+              history[i].lastFlowRate *
+                  (history[i].actuationDelay / 1000.0f); // Drippage
     float x = history[i].lastFlowRate;
     float res = y - ((x * prefs.systemLag) + flowCompBias[currentProfileIndex]);
 
@@ -252,25 +383,54 @@ int BrewManager::getBrewTimeSeconds() {
   return 0;
 }
 
-void BrewManager::sendAutoBrewLog() {
-  if (prefs.apiUrl.length() == 0 || prefs.apiToken.length() == 0) {
+uint32_t BrewManager::getShotSpikes() {
+  return sManager->getSpikeCount() - shotStartSpikes;
+}
+
+bool BrewManager::sendAutoBrewLog() {
+  if (prefs.apiUrl[0] == '\0' || prefs.apiToken[0] == '\0') {
     DEBUG_PRINTF("Auto-brew logging not configured\n");
-    return;
+    return false;
   }
 
   HTTPClient http;
   WiFiClient client;
 
-  String url = prefs.apiUrl + "/api/brews/auto-create";
+  char url[API_URL_LENGTH + 32];
+  snprintf(url, sizeof(url), "%s/api/brews/auto-create", prefs.apiUrl);
+  char authorization[API_TOKEN_LENGTH + 8];
+  snprintf(authorization, sizeof(authorization), "Bearer %s", prefs.apiToken);
 
   http.begin(client, url);
   http.addHeader("Content-Type", "application/json");
-  http.addHeader("Authorization", "Bearer " + prefs.apiToken);
+  http.addHeader("Authorization", authorization);
 
   JsonDocument doc;
   doc["yieldWeight"] = targetWeight;
   doc["brewTime"] = getBrewTimeSeconds();
   doc["isDecaf"] = isDecafTime();
+  if (scaleLost || blindStop) {
+    doc["scaleLost"] = true;
+  }
+  if (weightSeed > 0.0f) {
+    doc["scaleLate"] = true;
+  }
+  uint32_t spikes = getShotSpikes();
+  if (spikes > 0) {
+    doc["spikes"] = spikes;
+  }
+
+  JsonObject summary = doc["summary"].to<JsonObject>();
+  summary["peakFlow"] = shotSummary.peakFlow;
+  summary["meanFlow"] = shotSummary.meanFlow;
+  summary["flowStdDev"] = shotSummary.flowStdDev;
+  summary["firstDripTime"] = firstDripTime;
+  summary["preinfusionTime"] = shotSummary.preinfusionTime;
+  summary["contactTime"] = shotSummary.contactTime;
+  JsonArray marks = summary["weightAtMark"].to<JsonArray>();
+  for (int i = 0; i < WEIGHT_MARK_COUNT; i++) {
+    marks.add(shotSummary.weightAtMark[i]);
+  }
 
   String payload;
   serializeJson(doc, payload);
@@ -279,15 +439,16 @@ void BrewManager::sendAutoBrewLog() {
 
   if (httpCode == 201) {
     DEBUG_PRINTF("Auto-brew logged successfully\n");
-    pendingBeeps = 4;
   } else {
-    DEBUG_PRINTF("Failed to log brew: HTTP %d\n", httpCode);
+    WARN_PRINTF("Failed to log brew: HTTP %d\n", httpCode);
     if (httpCode > 0) {
       DEBUG_PRINTF("Response: %s\n", http.getString().c_str());
     }
   }
 
   http.end();
+
+  return httpCode == 201;
 }
 
 unsigned long BrewManager::getBrewTime() {
@@ -307,6 +468,39 @@ void BrewManager::wake() {
   if (!sManager->isConnected()) {
     sManager->connectScale();
   }
+
+  scheduler->notify(EVENT_COMMAND);
+}
+
+bool BrewManager::lockForUpdate() {
+  std::lock_guard<std::mutex> lock(claimMutex);
+
+  if (isBrewing() || waitingForMacro || startingShot)
+    return false;
+
+  updateLockTime = millis();
+  updating = true;
+  return true;
+}
+
+bool BrewManager::claimShot() {
+  std::lock_guard<std::mutex> lock(claimMutex);
+
+  if (isBrewing() || isUpdating() || startingShot)
+    return false;
+
+  startingShot = true;
+  return true;
+}
+
+void BrewManager::releaseShotClaim() {
+  // under the lock so the new state is seen by the next lockForUpdate
+  std::lock_guard<std::mutex> lock(claimMutex);
+  startingShot = false;
+}
+
+bool BrewManager::isUpdating() const {
+  return updating && millis() - updateLockTime.load() < UPDATE_LOCK_TIMEOUT;
 }
 
 void BrewManager::update() {
@@ -317,24 +511,43 @@ void BrewManager::update() {
 
   machine.update();
 
-  if (pendingBeeps > 0 && millis() - lastBeepTime > 150) {
-    sManager->beep();
-    pendingBeeps--;
-    lastBeepTime = millis();
+  // keep the scale link fast for the whole shot including drips, slow it
+  // right down otherwise
+  sManager->setLowLatency(state != IDLE);
+
+  // full clock from the first button press until the drips have settled, a
+  // press in idle might be the start of a shot
+  if (state != IDLE || waitingForMacro || machine.isStopPressed()) {
+    pManager->boost();
+  } else {
+    pManager->relax();
   }
 
+  // the idle link is cheap enough to keep up, we just stop trying to
+  // reconnect if the scale goes away
   if (active && millis() - lastActiveTime > ACTIVITY_TIMEOUT) {
     active = false;
-    sManager->disconnectScale();
   }
 
+  if (active)
+    scheduler->wakeAt(lastActiveTime + ACTIVITY_TIMEOUT + 1);
+  if (state != IDLE)
+    scheduler->wakeIn(BREW_TICK_MS);
+
   if (machine.isTwoCupStart()) {
     wake();
     return;
   }
 
-  if (!active)
-    return;
+  if (!active) {
+    // starting a shot wakes us up too, it gets tracked once the scale is
+    // connected
+    if (machine.isManualStart() || machine.isOneCupStart()) {
+      wake();
+    } else {
+      return;
+    }
+  }
 
   if (state == IDLE) {
     handleIdleState();
@@ -343,21 +556,33 @@ void BrewManager::update() {
   }
 }
 
+void BrewManager::setState(BrewState next, BrewEventCause cause) {
+  state = next;
+  events.add(BREW_EVENT_STATE, next, cause);
+}
+
 void BrewManager::handleIdleState() {
   if (waitingForMacro) {
     if (machine.isMacroComplete()) {
-      waitingForMacro = false;
       // macro only runs when weight triggered preinfusion is enabled and user
       // triggers a brew using the one cup button which doesn't support
       // arbitrary length preinfusion on hold so we can take the regular/decaf
       // preset and half it to get the target
       float target =
           isDecafTime() ? prefs.decafPreset / 2 : prefs.regularPreset / 2;
-      startBrew(target, false);
+      // still waiting until the shot has started, so an update can't get in
+      // between
+      startBrew(target, false, CAUSE_BUTTON);
+      waitingForMacro = false;
     }
     return;
   }
 
+  // the machine still brews if a button is pressed, we just don't touch the
+  // relay or track it while the flash is being written
+  if (isUpdating())
+    return;
+
   float baseTarget = prefs.regularPreset;
 
   if (isDecafTime()) {
@@ -365,16 +590,20 @@ void BrewManager::handleIdleState() {
   }
 
   if (machine.isManualStart()) {
-    startBrew(baseTarget, true);
+    shotTriggerUs = machine.getLastEdgeUs();
+    startBrew(baseTarget, true, CAUSE_BUTTON);
   } else if (machine.isOneCupStart()) {
+    shotTriggerUs = machine.getLastEdgeUs();
 
     float halfTarget = baseTarget / 2.0f;
 
     if (prefs.pMode == WEIGHT_TRIGGERED) {
-      machine.startPreinfusionMacro();
-      waitingForMacro = true;
+      if (claimShot()) {
+        waitingForMacro = machine.startPreinfusionMacro();
+        releaseShotClaim();
+      }
     } else {
-      startBrew(halfTarget, false);
+      startBrew(halfTarget, false, CAUSE_BUTTON);
     }
   }
 }
@@ -382,20 +611,36 @@ void BrewManager::handleIdleState() {
 void BrewManager::handleActiveState() {
   // check for brew cancellation
   if (machine.isStopPressed()) {
-    abortBrew(false);
+    abortBrew(false, CAUSE_BUTTON);
     return;
   }
 
   // failsafe
   if (state != DRIPPING && getBrewTime() >= MAX_SHOT_DURATION) {
-    finishBrew();
+    finishBrew(CAUSE_FAILSAFE);
     return;
   }
 
-  if (!sManager->isConnected())
+  if (awaitingScale) {
+    handlePendingScale();
+    if (awaitingScale || state == IDLE)
+      return;
+  }
+
+  if (scaleGone || sManager->isSignalLost()) {
+    handleScaleLoss();
     return;
+  }
+
+  if (scaleLost) {
+    // packets are back on the same connection so the tare still holds, take
+    // over from the prediction again
+    scaleLost = false;
+    WARN_PRINTF("Scale back after %lums\n",
+                (unsigned long)(sManager->getLastPacketTime() - lastGoodTime));
+  }
 
-  float rawWeight = sManager->getWeight();
+  float rawWeight = sManager->getWeight() + weightSeed;
   float flowRate = sManager->getFlowRate();
   uint32_t lastPacket = sManager->getLastPacketTime();
 
@@ -406,17 +651,46 @@ void BrewManager::handleActiveState() {
 
   ulong brewTime = getBrewTime();
 
+  // only feed the estimators with fresh packets
+  bool newSample = lastPacket != lastSampleTime;
+  lastSampleTime = lastPacket;
+
+  if (newSample) {
+    lastGoodWeight = rawWeight;
+    lastGoodFlow = flowRate;
+    lastGoodTime = lastPacket;
+  }
+
+  if (newSample && state != DRIPPING) {
+    shotStats.addSample(lastPacket, rawWeight, flowRate,
+                        onsetDetector.isTriggered());
+  }
+
+  if (newSample && state != DRIPPING && !onsetDetector.isTriggered() &&
+      onsetDetector.addSample(lastPacket, rawWeight)) {
+    uint32_t onset = onsetDetector.getOnsetTime();
+    firstDripTime = (onset > brewStartTime) ? onset - brewStartTime : 0;
+    DEBUG_PRINTF("First drips at %lums (detected at %lums)\n",
+                 (unsigned long)firstDripTime,
+                 brewTime);
+  }
+
   // transition preinf -> brewing if in weight triggered mode we lrelease relay
   // to go full pressure once first drops are detected
   if (state == PREINFUSION && prefs.pMode == WEIGHT_TRIGGERED &&
-      currentWeight >= 2.0f && brewTime > 2000) {
+      brewTime > MIN_PREINFUSION_TIME &&
+      (onsetDetector.isTriggered() ||
+       currentWeight >= PREINFUSION_WEIGHT_LIMIT)) {
     machine.releaseRelay();
-    state = BREWING;
+    shotStats.markPreinfusionEnd(millis());
+    setState(BREWING, CAUSE_ONSET);
   }
 
   // transition brewing | preinf -> dripping
   if (state == BREWING || state == PREINFUSION) {
-    float dynamicDrippage = flowRate * prefs.systemLag;
+    // full flow until the stop takes effect, then the drip model
+    float dynamicDrippage =
+        flowRate * (actuationDelay[getStopPath()] + prefs.systemLag);
 
     float staticDrippage = flowCompBias[currentProfileIndex];
 
@@ -424,34 +698,197 @@ void BrewManager::handleActiveState() {
         currentWeight + dynamicDrippage + staticDrippage;
 
     if (projectedFinalWeight >= targetWeight) {
-      finishBrew();
+      finishBrew(CAUSE_PROJECTION);
     }
   }
 
   // transition dripping -> idle
   if (state == DRIPPING) {
-    if (prefs.earlyStop) {
-      if (currentWeight >= earlyStopBaseWeight + 0.1f) {
-        earlyStopBaseWeight = currentWeight;
-        earlyStopBaseTime = millis();
-      } else if (millis() - earlyStopBaseTime >= 2500) {
-        finalizeBrew();
-        state = IDLE;
-        return;
-      }
+    updateDripping(rawWeight, flowRate, lastPacket, newSample);
+  }
+}
+
+void BrewManager::updateDripping(float rawWeight, float flowRate,
+                                 uint32_t lastPacket, bool newSample) {
+  if (newSample && !actuationMeasured) {
+    updateActuation(rawWeight, lastPacket);
+  }
+
+  if (newSample && lastPacket >= brewEndTime) {
+    dripEstimator.addSample((lastPacket - brewEndTime) / 1000.0f, rawWeight,
+                            flowRate);
+  }
+
+  if (dripEstimator.isSettled(DRIP_TOLERANCE)) {
+    finalWeight = dripEstimator.getFinalWeight();
+    DEBUG_PRINTF("Drip settled, final weight %.2f (tau %.2fs)\n", finalWeight,
+                 dripEstimator.getTimeConstant());
+    finalizeBrew();
+    setState(IDLE, CAUSE_SETTLED);
+    return;
+  }
+
+  if (prefs.earlyStop) {
+    if (currentWeight >= earlyStopBaseWeight + 0.1f) {
+      earlyStopBaseWeight = currentWeight;
+      earlyStopBaseTime = millis();
+    } else if (millis() - earlyStopBaseTime >= 2500) {
+      finalWeight = currentWeight;
+      finalizeBrew();
+      setState(IDLE, CAUSE_EARLY_STOP);
+      return;
     }
+  }
+
+  if (millis() >= brewEndTime + DRIP_SETTLE_TIME) {
+    // if we still have a valid fit, the asymptote includes the slow tail
+    // that hasn't landed yet
+    finalWeight = dripEstimator.hasFit() ? dripEstimator.getFinalWeight()
+                                         : currentWeight;
+    finalizeBrew();
+    setState(IDLE, CAUSE_TIMEOUT);
+  }
+}
+
+void BrewManager::updateActuation(float rawWeight, uint32_t lastPacket) {
+  if (lastFlowRate < MIN_ACTUATION_FLOW || lastPacket < brewEndTime ||
+      lastPacket - brewEndTime > MAX_ACTUATION_DELAY)
+    return;
+
+  // where the weight would be if the pump had kept going
+  float expected =
+      stopWeight + lastFlowRate * (lastPacket - stopRefTime) / 1000.0f;
+  float deficit = expected - rawWeight;
 
-    if (millis() >= brewEndTime + DRIP_SETTLE_TIME) {
+  if (deficit < COLLAPSE_DEFICIT)
+    return;
+
+  // with the flow cut off at some point, the deficit has been building at
+  // the pre-stop rate since then. relative to the stop, millis() itself is
+  // too big for a float after a few hours up
+  float sinceStop =
+      (float)(lastPacket - brewEndTime) - deficit / lastFlowRate * 1000.0f;
+
+  measuredActuationDelay = sinceStop > 0.0f ? (uint32_t)sinceStop : 0;
+  actuationMeasured = true;
+}
+
+StopPath BrewManager::getStopPath() const {
+  if (state == PREINFUSION && prefs.pMode == WEIGHT_TRIGGERED)
+    return STOP_FROM_PREINFUSION;
+  return STOP_CLICK;
+}
+
+void BrewManager::handleScaleLoss() {
+  // a reconnect starts over with a fresh tare, nothing after it lines up
+  // with the shot any more
+  if (!sManager->isConnected())
+    scaleGone = true;
+
+  if (state == DRIPPING) {
+    // the pump's already stopped so there's no hurry, a short gap gets the
+    // chance to come back before we settle for the last weight we saw
+    uint32_t silence = millis() - sManager->getLastPacketTime();
+    if (scaleGone || silence >= DRIP_LOSS_TIMEOUT ||
+        millis() >= brewEndTime + DRIP_SETTLE_TIME) {
+      scaleLost = true;
+      finalWeight = lastGoodWeight;
       finalizeBrew();
-      state = IDLE;
+      setState(IDLE, CAUSE_FAILSAFE);
     }
+    return;
+  }
+
+  if (!scaleLost) {
+    scaleLost = true;
+
+    // can't wait for drips without a scale, go to full pressure
+    if (state == PREINFUSION && prefs.pMode == WEIGHT_TRIGGERED) {
+      machine.releaseRelay();
+      setState(BREWING, CAUSE_FAILSAFE);
+    }
+
+    // project forward from the last good packet to when the usual stop
+    // condition would have been hit
+    float flow = fmaxf(lastGoodFlow, FALLBACK_FLOW_RATE);
+    // same as the live projection, the flow runs on until the machine
+    // reacts and then drips
+    float drippage =
+        flow * (actuationDelay[getStopPath()] + prefs.systemLag) +
+        flowCompBias[currentProfileIndex];
+    float remaining = targetWeight - drippage - lastGoodWeight;
+
+    uint32_t from =
+        (lastGoodTime > brewStartTime) ? lastGoodTime : brewStartTime;
+    predictedStopTime =
+        from + (remaining > 0 ? (ulong)(remaining / flow * 1000.0f) : 0);
+
+    WARN_PRINTF("Scale lost at %.2fg, stopping in %ldms\n", lastGoodWeight,
+                (long)(predictedStopTime - millis()));
+  }
+
+  if (millis() >= predictedStopTime) {
+    finishBrew(CAUSE_FAILSAFE);
   }
 }
 
-bool BrewManager::startBrew(float target, bool shouldTriggerRelay) {
-  if (!prefs.isEnabled || !sManager->isConnected() || isBrewing())
+void BrewManager::handlePendingScale() {
+  if (!sManager->isConnected() ||
+      sManager->getPacketCount() == pendingPacketCount) {
+    // conservative time guard, assume a fast shot and stop early rather than
+    // risk overflowing the cup
+    ulong guard =
+        PENDING_DEAD_TIME + (ulong)(targetWeight / PENDING_GUARD_FLOW * 1000);
+
+    if (getBrewTime() >= guard) {
+      WARN_PRINTF("Scale never connected, stopping on time guard\n");
+      scaleLost = true;
+      finishBrew(CAUSE_FAILSAFE);
+      // no scale to measure drips with
+      finalWeight = targetWeight;
+      finalizeBrew();
+      setState(IDLE, CAUSE_FAILSAFE);
+    }
+    return;
+  }
+
+  awaitingScale = false;
+
+  // whatever is on the scale now (cup and any coffee so far) becomes zero,
+  // add back our estimate of what already made it into the cup
+  sManager->startAndTare();
+
+  ulong elapsed = getBrewTime();
+  if (state == BREWING && elapsed > PENDING_DEAD_TIME) {
+    weightSeed = (elapsed - PENDING_DEAD_TIME) / 1000.0f * PENDING_SEED_FLOW;
+  }
+
+  lastSampleTime = sManager->getLastPacketTime();
+  lastGoodTime = lastSampleTime;
+  lastGoodWeight = weightSeed;
+
+  DEBUG_PRINTF("Scale connected %lums into the shot, seeding %.2fg\n", elapsed,
+               weightSeed);
+}
+
+bool BrewManager::startBrew(float target, bool shouldTriggerRelay,
+                            BrewEventCause cause) {
+  // the last shot's stop sequence is still clicking, the relay is busy
+  if (!prefs.isEnabled || machine.isStopping())
     return false;
 
+  // nothing below may happen while the flash is being written
+  if (!claimShot())
+    return false;
+
+  // a button press was logged before we knew it started a shot
+  events.beginShot(cause == CAUSE_BUTTON ? shotTriggerUs
+                                         : esp_timer_get_time());
+
+  // makes sure we're awake and connecting if we weren't already
+  wake();
+  pManager->boost();
+
   targetWeight = target;
   lastActiveTime = millis();
 
@@ -462,50 +899,78 @@ bool BrewManager::startBrew(float target, bool shouldTriggerRelay) {
   }
 
   brewStartTime = millis();
-  sManager->startAndTare();
+  sManager->setLowLatency(true);
+
+  awaitingScale = !sManager->isConnected();
+  pendingPacketCount = sManager->getPacketCount();
+  weightSeed = 0.0f;
+
+  if (!awaitingScale) {
+    sManager->startAndTare();
+  }
+
+  shotStartSpikes = sManager->getSpikeCount();
+
+  // anything from before the tare is of no use to the estimators
+  lastSampleTime = sManager->getLastPacketTime();
+  onsetDetector.reset();
+  firstDripTime = 0;
+  shotStats.reset(brewStartTime);
+
+  scaleLost = false;
+  scaleGone = false;
+  blindStop = false;
+  lastGoodWeight = 0.0f;
+  lastGoodFlow = 0.0f;
+  lastGoodTime = lastSampleTime;
 
   if (!shouldTriggerRelay) {
-    state = (prefs.pMode == SIMPLE) ? BREWING : PREINFUSION;
+    setState((prefs.pMode == SIMPLE) ? BREWING : PREINFUSION, cause);
   } else {
     if (prefs.pMode == SIMPLE) {
       machine.clickRelay();
-      state = BREWING;
+      setState(BREWING, cause);
     } else {
       machine.holdRelay();
-      state = PREINFUSION;
+      setState(PREINFUSION, cause);
     }
   }
 
+  releaseShotClaim();
   return true;
 }
 
-bool BrewManager::abortBrew(bool shouldTriggerRelay) {
+bool BrewManager::abortBrew(bool shouldTriggerRelay, BrewEventCause cause) {
   // user pressed the button so machine is stopping physically, just need to
   // reset logic
 
   if (state == IDLE || state == DRIPPING)
     return false;
 
+  // a click straight after the stop sequence would cut it short and leave
+  // the machine running, the stop already takes care of it
   if (state == PREINFUSION) {
     machine.stopFromPreinfusion();
-  }
-
-  if (shouldTriggerRelay) {
+  } else if (shouldTriggerRelay) {
     machine.clickRelay();
   }
 
-  state = IDLE;
+  setState(IDLE, cause);
   sManager->stopTimer();
   waitingForMacro = false;
+  awaitingScale = false;
+
+  scheduler->notify(EVENT_COMMAND);
   return true;
 }
 
-bool BrewManager::finishBrew() {
+bool BrewManager::finishBrew(BrewEventCause cause) {
   if (state == IDLE)
     return false;
 
   // software stop here, use relay to stop the brew
-  if (state == PREINFUSION && prefs.pMode == WEIGHT_TRIGGERED) {
+  stopPath = getStopPath();
+  if (stopPath == STOP_FROM_PREINFUSION) {
     machine.stopFromPreinfusion();
   } else {
     machine.clickRelay();
@@ -513,14 +978,21 @@ bool BrewManager::finishBrew() {
 
   DEBUG_PRINTF("SETTING BREW TO DRIPPING\n");
 
-  state = DRIPPING;
+  setState(DRIPPING, cause);
   brewEndTime = millis();
-  lastFlowRate = sManager->getFlowRate();
-  stopWeight = sManager->getWeight();
+  blindStop = scaleLost;
+  lastFlowRate = blindStop ? lastGoodFlow : sManager->getFlowRate();
+  stopWeight = blindStop ? lastGoodWeight : sManager->getWeight() + weightSeed;
+  // the weight above is from the last packet, not from right now
+  stopRefTime = blindStop ? lastGoodTime : sManager->getLastPacketTime();
+  actuationMeasured = false;
+  measuredActuationDelay = 0;
 
   earlyStopBaseTime = brewEndTime;
   earlyStopBaseWeight = stopWeight;
 
+  dripEstimator.reset();
+
   sManager->stopTimer();
   return true;
 }
@@ -537,6 +1009,12 @@ float BrewManager::getFlowCompBias(int profileIndex) {
   return flowCompBias[1];
 }
 
+const AccuracyTracker &BrewManager::getAccuracy(int profileIndex) {
+  if (profileIndex == 0)
+    return accuracy[0];
+  return accuracy[1];
+}
+
 bool BrewManager::isDecafTime() {
   if (prefs.decafStartHour < 0)
     return false;
@@ -550,6 +1028,6 @@ bool BrewManager::isDecafTime() {
 }
 
 void BrewManager::syncTimezone() {
-  setenv("TZ", prefs.timezone.c_str(), 1);
+  setenv("TZ", prefs.timezone, 1);
   tzset();
 }
\ No newline at end of file
@@ -1,10 +1,19 @@
 #ifndef BREW_MANAGER_H
 #define BREW_MANAGER_H
 
+#include "AccuracyTracker.h"
+#include "BrewEventLog.h"
+#include "DripEstimator.h"
+#include "FlowOnsetDetector.h"
 #include "MachineController.h"
+#include "PowerManager.h"
 #include "ScaleManager.h"
+#include "Scheduler.h"
+#include "ShotStats.h"
 #include <Arduino.h>
 #include <Preferences.h>
+#include <atomic>
+#include <mutex>
 
 class ScaleManager;
 
@@ -25,17 +34,29 @@ enum BrewState { IDLE, PREINFUSION, BREWING, DRIPPING };
  */
 enum PreinfusionMode { SIMPLE, WEIGHT_TRIGGERED };
 
+/**
+ * How the pump gets stopped, each has its own actuation delay
+ * STOP_CLICK            -> single relay click
+ * STOP_FROM_PREINFUSION -> release the held relay, then click
+ */
+enum StopPath { STOP_CLICK, STOP_FROM_PREINFUSION, STOP_PATH_COUNT };
+
+// fixed size so copying the prefs around never touches the heap
+static constexpr size_t TIMEZONE_LENGTH = 64;
+static constexpr size_t API_URL_LENGTH = 128;
+static constexpr size_t API_TOKEN_LENGTH = 256;
+
 struct BrewPrefs {
   bool isEnabled = true;
   float regularPreset = 40.0f;
   float decafPreset = 40.0f;
   PreinfusionMode pMode = SIMPLE;
-  String timezone = "GMT0";
+  char timezone[TIMEZONE_LENGTH] = "GMT0";
   int decafStartHour = -1;
   float learningRate = 0.5f;
   float systemLag = 1.0f;
-  String apiUrl = "";
-  String apiToken = "";
+  char apiUrl[API_URL_LENGTH] = "";
+  char apiToken[API_TOKEN_LENGTH] = "";
   bool autoSavePreset = false;
   bool earlyStop = false;
 };
@@ -46,6 +67,11 @@ struct Shot {
   float finalWeight;
   float lastFlowRate;
   float stopWeight;
+  uint32_t firstDripTime; // ms from brew start, 0 if never detected
+  // ms from the stop command until the flow collapsed. the learned delay if
+  // it couldn't be measured on this shot
+  uint32_t actuationDelay;
+  ShotSummary summary;
 };
 
 class BrewManager {
@@ -57,15 +83,21 @@ private:
   static BrewManager *instance;
 
   // deps
+  BrewEventLog events;
   MachineController machine;
   ScaleManager *sManager;
+  PowerManager *pManager;
+  Scheduler *scheduler;
   Preferences preferences;
 
   BrewPrefs prefs;
 
   // state
   bool active = false;
-  bool waitingForMacro = false;
+  std::atomic<bool> waitingForMacro{false};
+  // button edge that started the shot, the macro can run for a while before
+  // the shot actually starts
+  int64_t shotTriggerUs = 0;
 
   uint32_t globalShotCounter = 0;
 
@@ -76,6 +108,7 @@ private:
   float currentWeight;
   float lastFlowRate;
   float stopWeight;
+  float finalWeight;
 
   ulong brewStartTime = 0;
   ulong brewEndTime = 0;
@@ -84,9 +117,49 @@ private:
   ulong earlyStopBaseTime = 0;
   float earlyStopBaseWeight = 0.0f;
 
-  // beep stuff
-  int pendingBeeps = 0;
-  ulong lastBeepTime = 0;
+  // receive time of the last scale packet fed to the estimators
+  uint32_t lastSampleTime = 0;
+
+  // first drip detection
+  FlowOnsetDetector onsetDetector;
+  uint32_t firstDripTime = 0;
+
+  // post-stop drip curve fit
+  DripEstimator dripEstimator;
+
+  // running summary of the shot, finalised when it's done
+  ShotStats shotStats;
+  ShotSummary shotSummary = {};
+
+  // actuation delay, measured on every shot as the time from the stop
+  // command until the weight stops following the pre-stop flow
+  float actuationDelay[STOP_PATH_COUNT];
+  StopPath stopPath = STOP_CLICK;
+  uint32_t stopRefTime = 0;
+  bool actuationMeasured = false;
+  uint32_t measuredActuationDelay = 0;
+
+  // scale loss fallback, the shot is finished by prediction from the last
+  // good weight and flow estimate. packets coming back on the same
+  // connection hand control back, a disconnect doesn't
+  bool scaleLost = false;
+  bool scaleGone = false;
+  // stopped by prediction, the stop weight is a guess
+  bool blindStop = false;
+  float lastGoodWeight = 0.0f;
+  float lastGoodFlow = 0.0f;
+  uint32_t lastGoodTime = 0;
+  ulong predictedStopTime = 0;
+
+  // pending brew, started before the scale was connected. the pump runs on a
+  // time guard until the first packet arrives, then we tare and estimate
+  // what went into the cup in the meantime
+  bool awaitingScale = false;
+  uint32_t pendingPacketCount = 0;
+  float weightSeed = 0.0f;
+
+  // spike filter count when the shot started
+  uint32_t shotStartSpikes = 0;
 
   // constants
   static const uint ACTIVITY_TIMEOUT = 10 * 60 * 1000;
@@ -97,7 +170,56 @@ private:
   static constexpr float MIN_BIAS = -5.0f;
   static constexpr float MAX_BIAS = 5.0f;
 
+  // ignore anything before this in weight triggered preinfusion, the pump
+  // kicking in can shake the scale
+  static constexpr ulong MIN_PREINFUSION_TIME = 1000;
+  // release preinfusion regardless of the detector once this is in the cup
+  static constexpr float PREINFUSION_WEIGHT_LIMIT = 2.0f;
+
+  // flow assumed for the prediction if we lose the scale before the shot
+  // has really got going
+  static constexpr float FALLBACK_FLOW_RATE = 1.5f;
+
+  // pending brew guard and seed. typical time until first drips, typical
+  // flow after that, and a deliberately fast flow for the guard so we'd
+  // rather stop short than overflow the cup
+  static constexpr ulong PENDING_DEAD_TIME = 5000;
+  static constexpr float PENDING_SEED_FLOW = 2.0f;
+  static constexpr float PENDING_GUARD_FLOW = 3.0f;
+
+  // upper bound on the dripping stage, the drip fit usually finishes earlier
   static constexpr ulong DRIP_SETTLE_TIME = 10 * 1000;
+  // finish dripping once the fit predicts less than this is left to land
+  static constexpr float DRIP_TOLERANCE = 0.1f;
+  // silence in the dripping stage before we give up on the scale
+  static constexpr uint32_t DRIP_LOSS_TIMEOUT = 3000;
+
+  // how far below the pre-stop flow line the weight has to fall before we
+  // call the flow collapsed, and how long we look for it
+  static constexpr float COLLAPSE_DEFICIT = 0.5f;
+  static constexpr uint32_t MAX_ACTUATION_DELAY = 2000;
+  // below this flow the collapse is lost in the noise
+  static constexpr float MIN_ACTUATION_FLOW = 0.5f;
+  static constexpr float ACTUATION_LEARNING_RATE = 0.3f;
+
+  // a few bumps are filtered out and the shot is still fine to learn from,
+  // more than this and the scale was being handled during the shot
+  static constexpr uint32_t MAX_SHOT_SPIKES = 10;
+
+  // packets wake the loop on their own, but the stop projection moves on
+  // between them and the timeouts need checking too
+  static constexpr uint32_t BREW_TICK_MS = 10;
+
+  // firmware is being written, no shots until it's done. the lock expires in
+  // case an upload dies without telling us
+  std::atomic<bool> updating{false};
+  std::atomic<uint32_t> updateLockTime{0};
+  // the update lock runs on the web server task and shots start on the loop,
+  // both check the other and claim under this so they can't both get in
+  std::mutex claimMutex;
+  // set while startBrew is between its checks and the new state
+  bool startingShot = false;
+  static constexpr uint32_t UPDATE_LOCK_TIMEOUT = 5 * 60 * 1000;
 
   // threshold to decide between profile 0 (split shots) and profile 1 (full)
   static constexpr float PROFILE_THRESHOLD_WEIGHT = 28.0f;
@@ -105,8 +227,20 @@ private:
   // seperate history for each profile to prevent learning pollution
   Shot recentShotsProfile0[MAX_HISTORY];
   Shot recentShotsProfile1[MAX_HISTORY];
+  // state version each shot was recorded at, 0 for ones from before we
+  // kept track
+  uint32_t shotVersions[2][MAX_HISTORY] = {};
+
+  // bumped whenever anything /data or /prefs returns changes, so clients can
+  // skip fetching what they already have. kept across reboots
+  std::atomic<uint32_t> stateVersion{1};
+  // version of the last clearShotData, anything older can't be caught up
+  // with just the new shots
+  std::atomic<uint32_t> resetVersion{0};
 
   float flowCompBias[2];
+  // stop accuracy per profile, over every shot rather than just the history
+  AccuracyTracker accuracy[2];
   int currentProfileIndex = 1;
 
   // helpers
@@ -114,14 +248,27 @@ private:
   void loadSettings();
   void saveSettings();
   void finalizeBrew();
-  void sendAutoBrewLog();
+  void recordShot();
+  void bumpStateVersion() { stateVersion++; }
+  void updateActuation(float rawWeight, uint32_t lastPacket);
+  void setActuationDelay(StopPath path, float delay);
+  StopPath getStopPath() const;
+  void updateDripping(float rawWeight, float flowRate, uint32_t lastPacket,
+                      bool newSample);
+  bool sendAutoBrewLog();
   int getBrewTimeSeconds();
+  uint32_t getShotSpikes();
 
   bool isDecafTime();
+  bool claimShot();
+  void releaseShotClaim();
 
   // internal state handlers
   void handleIdleState();
   void handleActiveState();
+  void setState(BrewState next, BrewEventCause cause);
+  void handleScaleLoss();
+  void handlePendingScale();
 
 public:
   static BrewManager *getInstance() {
@@ -138,17 +285,26 @@ public:
 
   // startBrew called by API or logic
   // if shouldTriggerRelay = false, assume the button is already being pressed
-  // by the user/macro
-  bool startBrew(float target, bool shouldTriggerRelay = false);
+  // by the user/macro. if the scale isn't connected yet the brew starts
+  // anyway and weight tracking picks up once it is
+  bool startBrew(float target, bool shouldTriggerRelay = false,
+                 BrewEventCause cause = CAUSE_API);
 
   // user pressed a button, cancelling brew, doesn't trigger relay
-  bool abortBrew(bool shouldTriggerRelay = false);
+  bool abortBrew(bool shouldTriggerRelay = false,
+                 BrewEventCause cause = CAUSE_API);
 
   // target weight or other finishing condition reached. stop tracking and
   // trigger relay  to stop brewing
-  bool finishBrew();
+  bool finishBrew(BrewEventCause cause);
 
   void wake();
+
+  // ota, fails if a shot is running
+  bool lockForUpdate();
+  void unlockForUpdate() { updating = false; }
+  bool isUpdating() const;
+
   bool isActive() { return active; }
   bool isBrewing() const { return state != IDLE; }
   bool isEnabled() const { return prefs.isEnabled; }
@@ -158,13 +314,23 @@ public:
 
   void clearShotData();
 
-  BrewPrefs getPrefs();
-  void setPrefs(BrewPrefs prefs);
+  const BrewPrefs &getPrefs() const { return prefs; }
+  void setPrefs(const BrewPrefs &prefs);
 
   Shot *getRecentShots(int profileIndex);
+  const uint32_t *getShotVersions(int profileIndex) const {
+    return shotVersions[profileIndex == 0 ? 0 : 1];
+  }
+  uint32_t getStateVersion() const { return stateVersion.load(); }
+  uint32_t getResetVersion() const { return resetVersion.load(); }
   float getFlowCompBias(int profileIndex);
+  const AccuracyTracker &getAccuracy(int profileIndex);
+  // seconds
+  float getActuationDelay(StopPath path) const { return actuationDelay[path]; }
 
   void syncTimezone();
+
+  BrewEventLog &getEventLog() { return events; }
 };
 
 #endif
@@ -0,0 +1,94 @@
+#include "DripEstimator.h"
+#include <cmath>
+
+void DripEstimator::reset() {
+  peakFlow = 0.0f;
+  decaying = false;
+
+  lastTime = 0.0f;
+  lastWeight = 0.0f;
+  lastFlow = 0.0f;
+
+  n = 0;
+  sumT = sumY = sumTY = sumTT = 0;
+}
+
+void DripEstimator::addSample(float timeSecs, float weight, float flowRate) {
+  lastTime = timeSecs;
+  lastWeight = weight;
+  lastFlow = flowRate;
+
+  if (flowRate > peakFlow) {
+    peakFlow = flowRate;
+  }
+
+  // only start fitting once the flow has clearly started to fall off
+  if (!decaying) {
+    if (timeSecs < MIN_FIT_TIME || flowRate > peakFlow * 0.9f)
+      return;
+    decaying = true;
+  }
+
+  if (flowRate < FLOW_FLOOR)
+    return;
+
+  double y = std::log(flowRate);
+
+  sumT += timeSecs;
+  sumY += y;
+  sumTY += timeSecs * y;
+  sumTT += (double)timeSecs * timeSecs;
+  n++;
+}
+
+bool DripEstimator::solve(double &intercept, double &slope) const {
+  if (n < MIN_FIT_SAMPLES)
+    return false;
+
+  double denom = (n * sumTT) - (sumT * sumT);
+  if (std::fabs(denom) < 1e-6)
+    return false;
+
+  slope = ((n * sumTY) - (sumT * sumY)) / denom;
+  intercept = (sumY - slope * sumT) / n;
+
+  // flow has to actually be decaying, and not absurdly slowly
+  return slope < -(1.0 / MAX_TIME_CONSTANT);
+}
+
+bool DripEstimator::hasFit() const {
+  double a, b;
+  return solve(a, b);
+}
+
+float DripEstimator::getRemaining() const {
+  double a, b;
+  if (!solve(a, b))
+    return 0.0f;
+
+  // integral of the fitted flow from now to infinity
+  double flowNow = std::exp(a + b * lastTime);
+  return (float)(flowNow / -b);
+}
+
+float DripEstimator::getFinalWeight() const {
+  return lastWeight + getRemaining();
+}
+
+float DripEstimator::getTimeConstant() const {
+  double a, b;
+  if (!solve(a, b))
+    return 0.0f;
+  return (float)(-1.0 / b);
+}
+
+bool DripEstimator::isSettled(float tolerance) const {
+  if (lastTime < MIN_FIT_TIME)
+    return false;
+
+  // flow has already died off completely
+  if (decaying && lastFlow < FLOW_FLOOR)
+    return true;
+
+  return hasFit() && getRemaining() < tolerance;
+}
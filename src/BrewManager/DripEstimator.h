@@ -0,0 +1,57 @@
+#ifndef DRIP_ESTIMATOR_H
+#define DRIP_ESTIMATOR_H
+
+#include <Arduino.h>
+
+/**
+ * Online fit of the post-stop drip curve.
+ *
+ * After the pump stops, the flow into the cup decays roughly exponentially:
+ *   flow(t) = f0 * exp(-t / tau)
+ * so the weight approaches an asymptote W = w(t) + flow(t) * tau.
+ *
+ * We regress ln(flow) against time as samples arrive, which gives us the decay
+ * rate (1 / tau) and lets us predict how much is still left to drip without
+ * waiting for the tail to actually land.
+ */
+class DripEstimator {
+public:
+  void reset();
+
+  // timeSecs is measured from the moment the stop command was sent
+  void addSample(float timeSecs, float weight, float flowRate);
+
+  bool hasFit() const;
+  bool isSettled(float tolerance) const;
+
+  // predicted weight still to land in the cup
+  float getRemaining() const;
+  // asymptote of the drip curve (or the latest weight if we have no fit)
+  float getFinalWeight() const;
+  float getTimeConstant() const;
+
+private:
+  // ignore the first part of the curve, the solenoid/valve is still closing
+  // and flow hasn't started decaying yet
+  static constexpr float MIN_FIT_TIME = 1.0f;
+  // flow below this is considered noise
+  static constexpr float FLOW_FLOOR = 0.05f;
+  static constexpr int MIN_FIT_SAMPLES = 6;
+  // anything slower than this isn't a drip decay (cup moved, scale touched)
+  static constexpr float MAX_TIME_CONSTANT = 10.0f;
+
+  float peakFlow = 0.0f;
+  bool decaying = false;
+
+  float lastTime = 0.0f;
+  float lastWeight = 0.0f;
+  float lastFlow = 0.0f;
+
+  // regression sums for ln(flow) = a + b * t
+  int n = 0;
+  double sumT = 0, sumY = 0, sumTY = 0, sumTT = 0;
+
+  bool solve(double &intercept, double &slope) const;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "FlowOnsetDetector.h"
+#include <cmath>
+
+void FlowOnsetDetector::reset() {
+  hasPrev = false;
+  prevTime = 0;
+  prevWeight = 0.0f;
+
+  baselineNoise = INITIAL_NOISE;
+
+  cusum = 0.0f;
+  lastZeroTime = 0;
+
+  triggered = false;
+  onsetTime = 0;
+}
+
+bool FlowOnsetDetector::addSample(uint32_t timeMs, float weight) {
+  if (triggered)
+    return false;
+
+  if (!hasPrev || timeMs <= prevTime) {
+    hasPrev = true;
+    prevTime = timeMs;
+    prevWeight = weight;
+    lastZeroTime = timeMs;
+    return false;
+  }
+
+  float derivative = (weight - prevWeight) / ((timeMs - prevTime) / 1000.0f);
+
+  prevTime = timeMs;
+  prevWeight = weight;
+
+  if (std::fabs(derivative) > MAX_DERIVATIVE) {
+    // discontinuity, start accumulating again from here
+    cusum = 0.0f;
+    lastZeroTime = timeMs;
+    return false;
+  }
+
+  float drift = fmaxf(MIN_DRIFT, DRIFT_SIGMAS * baselineNoise);
+  float threshold = fmaxf(MIN_THRESHOLD, THRESHOLD_SIGMAS * baselineNoise);
+
+  // nothing flowing means a zero derivative, anything above that (plus the
+  // drift allowance) is evidence of flow
+  cusum = std::max(0.0f, cusum + derivative - drift);
+
+  if (cusum < threshold) {
+    // keep learning what "nothing" looks like, clipped so a single knock
+    // can't blow the threshold up
+    float dev = std::min(std::fabs(derivative), threshold);
+    baselineNoise += NOISE_ALPHA * (dev - baselineNoise);
+  }
+
+  // within a single sample's worth of noise of zero still counts as nothing
+  // happening yet
+  if (cusum <= drift) {
+    lastZeroTime = timeMs;
+    return false;
+  }
+
+  if (cusum > threshold && weight >= MIN_ONSET_WEIGHT) {
+    triggered = true;
+    // the change started right after the cusum last sat near zero
+    onsetTime = lastZeroTime;
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,57 @@
+#ifndef FLOW_ONSET_DETECTOR_H
+#define FLOW_ONSET_DETECTOR_H
+
+#include <Arduino.h>
+
+/**
+ * Streaming change-point detector for the first drips of a shot.
+ *
+ * Runs a one-sided CUSUM on the weight derivative. While nothing is flowing
+ * it learns the noise of the derivative, accumulates evidence of a sustained
+ * positive shift and fires once that crosses a threshold scaled to the
+ * noise. The onset is the last sample where the CUSUM was
+ * still at zero, i.e. where the flow actually started, not where we became
+ * sure of it.
+ */
+class FlowOnsetDetector {
+public:
+  void reset();
+
+  // returns true on the sample that triggers detection
+  bool addSample(uint32_t timeMs, float weight);
+
+  bool isTriggered() const { return triggered; }
+  // time (same clock as the samples) the flow started
+  uint32_t getOnsetTime() const { return onsetTime; }
+
+private:
+  // derivative noise assumed before we've learnt anything, g/s
+  static constexpr float INITIAL_NOISE = 0.2f;
+  static constexpr float NOISE_ALPHA = 0.1f;
+
+  // drift allowance and threshold, in units of baseline noise
+  static constexpr float DRIFT_SIGMAS = 0.5f;
+  static constexpr float THRESHOLD_SIGMAS = 4.0f;
+  // floors so a dead quiet scale can't make us trigger on a single count
+  static constexpr float MIN_DRIFT = 0.1f;
+  static constexpr float MIN_THRESHOLD = 0.5f;
+
+  // something has to actually be in the cup
+  static constexpr float MIN_ONSET_WEIGHT = 0.2f;
+  // a derivative this big is a tare step or a knock, not flow
+  static constexpr float MAX_DERIVATIVE = 20.0f;
+
+  bool hasPrev = false;
+  uint32_t prevTime = 0;
+  float prevWeight = 0.0f;
+
+  float baselineNoise = INITIAL_NOISE;
+
+  float cusum = 0.0f;
+  uint32_t lastZeroTime = 0;
+
+  bool triggered = false;
+  uint32_t onsetTime = 0;
+};
+
+#endif
@@ -1,6 +1,15 @@
 #include "MachineController.h"
+#include "Scheduler.h"
+#include "debug.h"
+
+// any edge on a button pin wakes the loop, debouncing still happens there
+static void IRAM_ATTR onButtonChange() {
+  Scheduler::getInstance()->notifyFromISR(EVENT_BUTTON);
+}
+
+void MachineController::begin(BrewEventLog *eventLog) {
+  events = eventLog;
 
-void MachineController::begin() {
   pinMode(MANUAL_PIN, INPUT_PULLUP);
   pinMode(ONE_CUP_PIN, INPUT_PULLUP);
   pinMode(TWO_CUP_PIN, INPUT_PULLUP);
@@ -9,8 +18,22 @@ void MachineController::begin() {
   digitalWrite(BREW_SWITCH_PIN, LOW);
 
   manualBtn.pin = MANUAL_PIN;
+  manualBtn.id = BUTTON_MANUAL;
   oneCupBtn.pin = ONE_CUP_PIN;
+  oneCupBtn.id = BUTTON_ONE_CUP;
   twoCupBtn.pin = TWO_CUP_PIN;
+  twoCupBtn.id = BUTTON_TWO_CUP;
+
+  attachInterrupt(digitalPinToInterrupt(MANUAL_PIN), onButtonChange, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(ONE_CUP_PIN), onButtonChange, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(TWO_CUP_PIN), onButtonChange, CHANGE);
+
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = onRelayTimer;
+  timerArgs.arg = this;
+  timerArgs.dispatch_method = ESP_TIMER_TASK;
+  timerArgs.name = "relay";
+  esp_timer_create(&timerArgs, &relayTimer);
 }
 
 void MachineController::update() {
@@ -18,77 +41,184 @@ void MachineController::update() {
   updateButton(oneCupBtn);
   updateButton(twoCupBtn);
 
-  if (relayActive && !relayLatching && millis() >= relayReleaseTime) {
-    digitalWrite(BREW_SWITCH_PIN, LOW);
-    relayActive = false;
+  // a pin that hasn't settled yet needs another look once the debounce time
+  // is up, there won't be an interrupt for that
+  Scheduler *scheduler = Scheduler::getInstance();
+  const DebouncedButton *buttons[] = {&manualBtn, &oneCupBtn, &twoCupBtn};
+  for (const DebouncedButton *btn : buttons) {
+    if (btn->lastRawState != btn->stableState)
+      scheduler->wakeAt(btn->lastChangeMs + BUTTON_DEBOUNCE_TIME);
   }
 
-  if (macroRunning) {
-    if (macroStep == 0 && millis() >= macroNextActionTime) {
-      // 200ms have passed since user pressed the brew button, we click the
-      // relay to stop that brew
-      clickRelay();
+  printEdgeLog();
+}
 
-      macroStep = 1;
+bool MachineController::clickRelay() {
+  const RelayEdge edges[] = {{0, HIGH}, {RELAY_PULSE_US, LOW}};
+  return runSequence(edges, 2, SEQUENCE_CLICK);
+}
 
-      macroNextActionTime = millis() + 500;
-    } else if (macroStep == 1 && millis() >= macroNextActionTime) {
-      // now we can start proper preinfusion via the relay;
-      holdRelay();
+bool MachineController::holdRelay() {
+  const RelayEdge edges[] = {{0, HIGH}};
+  return runSequence(edges, 1, SEQUENCE_HOLD);
+}
 
-      macroRunning = false;
-      macroFinished = true;
-    }
-  }
+bool MachineController::releaseRelay() {
+  const RelayEdge edges[] = {{0, LOW}};
+  return runSequence(edges, 1, SEQUENCE_RELEASE);
+}
 
-  if (stopSequenceRunning) {
-    if (millis() >= stopSequenceStepTime) {
-      stopSequenceRunning = false;
-      clickRelay();
-    }
-  }
+bool MachineController::startPreinfusionMacro() {
+  // the user pressed the brew button, click the relay to stop that brew and
+  // then hold it to start proper preinfusion
+  const RelayEdge edges[] = {
+      {MACRO_CLICK_DELAY_US, HIGH},
+      {MACRO_CLICK_DELAY_US + RELAY_PULSE_US, LOW},
+      {MACRO_CLICK_DELAY_US + MACRO_HOLD_DELAY_US, HIGH},
+  };
+  return runSequence(edges, 3, SEQUENCE_MACRO);
 }
 
-void MachineController::clickRelay() {
-  digitalWrite(BREW_SWITCH_PIN, HIGH);
-  relayActive = true;
-  relayLatching = false;
-  relayReleaseTime = millis() + RELAY_PULSE_TIME;
+bool MachineController::isMacroComplete() {
+  bool finished;
+
+  portENTER_CRITICAL(&relayMux);
+  finished = macroFinished;
+  macroFinished = false;
+  portEXIT_CRITICAL(&relayMux);
+
+  return finished;
 }
 
-void MachineController::holdRelay() {
-  digitalWrite(BREW_SWITCH_PIN, HIGH);
-  relayActive = true;
-  relayLatching = true;
+bool MachineController::stopFromPreinfusion() {
+  // release currently latched relay, lets machine go to full flow, then
+  // click to stop
+  const RelayEdge edges[] = {
+      {0, LOW},
+      {STOP_CLICK_DELAY_US, HIGH},
+      {STOP_CLICK_DELAY_US + RELAY_PULSE_US, LOW},
+  };
+  return runSequence(edges, 3, SEQUENCE_STOP_FROM_PREINFUSION);
 }
 
-void MachineController::releaseRelay() {
-  digitalWrite(BREW_SWITCH_PIN, LOW);
-  relayActive = false;
-  relayLatching = false;
+bool MachineController::isStopping() {
+  portENTER_CRITICAL(&relayMux);
+  bool stopping = sequenceKind == SEQUENCE_STOP_FROM_PREINFUSION &&
+                  sequenceIndex < sequenceLength;
+  portEXIT_CRITICAL(&relayMux);
+
+  return stopping;
 }
 
-void MachineController::startPreinfusionMacro() {
-  macroRunning = true;
+bool MachineController::runSequence(const RelayEdge *edges, size_t count,
+                                    RelaySequence kind) {
+  if (events)
+    events->add(BREW_EVENT_RELAY_REQUEST, kind);
+
+  portENTER_CRITICAL(&relayMux);
+
+  // the stop click hasn't fired yet, anything else now would cancel it
+  if (sequenceKind == SEQUENCE_STOP_FROM_PREINFUSION &&
+      sequenceIndex < sequenceLength) {
+    portEXIT_CRITICAL(&relayMux);
+
+    if (events)
+      events->add(BREW_EVENT_RELAY_DROPPED, kind);
+    DEBUG_PRINTF("Relay busy stopping, dropped sequence %d\n", kind);
+    return false;
+  }
+
+  if (relayTimer)
+    esp_timer_stop(relayTimer);
+
+  for (size_t i = 0; i < count && i < MAX_SEQUENCE_EDGES; i++) {
+    sequence[i] = edges[i];
+  }
+  sequenceLength = count < MAX_SEQUENCE_EDGES ? count : MAX_SEQUENCE_EDGES;
+  sequenceIndex = 0;
+  sequenceStartUs = esp_timer_get_time();
+  sequenceKind = kind;
+
+  macroRunning = kind == SEQUENCE_MACRO;
   macroFinished = false;
-  macroStep = 0;
 
-  macroNextActionTime = millis() + 200;
+  runDueEdges();
+
+  portEXIT_CRITICAL(&relayMux);
+  return true;
 }
 
-bool MachineController::isMacroComplete() {
-  if (macroFinished) {
-    macroFinished = false;
-    return true;
+// caller holds relayMux
+void MachineController::runDueEdges() {
+  while (sequenceIndex < sequenceLength) {
+    const RelayEdge &edge = sequence[sequenceIndex];
+    int64_t due = sequenceStartUs + edge.offsetUs;
+    int64_t now = esp_timer_get_time();
+
+    if (due > now) {
+      esp_timer_stop(relayTimer);
+      esp_timer_start_once(relayTimer, due - now);
+      return;
+    }
+
+    digitalWrite(BREW_SWITCH_PIN, edge.level);
+    int64_t switched = esp_timer_get_time();
+
+    if (events)
+      events->add(BREW_EVENT_RELAY_EDGE, edge.level, CAUSE_NONE, switched);
+
+    RelayEdgeRecord &record = edgeLog[edgeLogCount % EDGE_LOG_SIZE];
+    record.offsetUs = edge.offsetUs;
+    record.lateUs = (int32_t)(switched - due);
+    record.level = edge.level;
+    edgeLogCount++;
+
+    sequenceIndex++;
   }
-  return false;
+
+  if (macroRunning) {
+    macroRunning = false;
+    macroFinished = true;
+    if (events)
+      events->add(BREW_EVENT_MACRO_DONE, 0);
+  }
+}
+
+void MachineController::onRelayTimer(void *arg) {
+  MachineController *self = static_cast<MachineController *>(arg);
+
+  portENTER_CRITICAL(&self->relayMux);
+  self->runDueEdges();
+  bool finished = self->macroFinished;
+  portEXIT_CRITICAL(&self->relayMux);
+
+  // the loop is waiting on this to start the brew
+  if (finished)
+    Scheduler::getInstance()->notify(EVENT_TIMER);
 }
 
-void MachineController::stopFromPreinfusion() {
-  // release currently latched relay, lets machine go to full flow
-  releaseRelay();
-  stopSequenceRunning = true;
-  stopSequenceStepTime = millis() + 150;
+void MachineController::printEdgeLog() {
+#ifdef DEBUG_BUILD
+  while (true) {
+    RelayEdgeRecord record;
+
+    portENTER_CRITICAL(&relayMux);
+    // fell too far behind, skip what's been overwritten
+    if (edgeLogCount - edgeLogPrinted > EDGE_LOG_SIZE)
+      edgeLogPrinted = edgeLogCount - EDGE_LOG_SIZE;
+    bool pending = edgeLogPrinted != edgeLogCount;
+    if (pending)
+      record = edgeLog[edgeLogPrinted++ % EDGE_LOG_SIZE];
+    portEXIT_CRITICAL(&relayMux);
+
+    if (!pending)
+      break;
+
+    DEBUG_PRINTF("Relay %s: scheduled +%lums, late %ldus\n",
+                 record.level ? "HIGH" : "LOW",
+                 (unsigned long)(record.offsetUs / 1000), (long)record.lateUs);
+  }
+#endif
 }
 
 void MachineController::updateButton(DebouncedButton &btn) {
@@ -101,6 +231,7 @@ void MachineController::updateButton(DebouncedButton &btn) {
   if (raw != btn.lastRawState) {
     btn.lastRawState = raw;
     btn.lastChangeMs = now;
+    btn.lastChangeUs = esp_timer_get_time();
   } else if ((now - btn.lastChangeMs) >= BUTTON_DEBOUNCE_TIME &&
              raw != btn.stableState) {
     btn.stableState = raw;
@@ -108,5 +239,11 @@ void MachineController::updateButton(DebouncedButton &btn) {
       btn.fellEdge = true;
     else
       btn.roseEdge = true;
+
+    // stamped with when the pin settled, not the end of the debounce wait
+    lastEdgeUs = btn.lastChangeUs;
+    if (events)
+      events->add(BREW_EVENT_BUTTON, (btn.id << 1) | (raw ? 0 : 1),
+                  CAUSE_NONE, btn.lastChangeUs);
   }
 }
@@ -1,20 +1,47 @@
 #ifndef MACHINE_CONTROLLER_H
 #define MACHINE_CONTROLLER_H
 
+#include "BrewEventLog.h"
 #include <Arduino.h>
+#include <esp_timer.h>
+
+enum ButtonId : uint8_t { BUTTON_MANUAL, BUTTON_ONE_CUP, BUTTON_TWO_CUP };
+
+enum RelaySequence : uint8_t {
+  SEQUENCE_CLICK,
+  SEQUENCE_HOLD,
+  SEQUENCE_RELEASE,
+  SEQUENCE_MACRO,
+  SEQUENCE_STOP_FROM_PREINFUSION
+};
+
+// one relay transition, offset from the start of its sequence
+struct RelayEdge {
+  uint32_t offsetUs;
+  bool level;
+};
+
+// when an edge was meant to happen vs when it did, for checking the timing
+struct RelayEdgeRecord {
+  uint32_t offsetUs;
+  int32_t lateUs;
+  bool level;
+};
 
 struct DebouncedButton {
   uint8_t pin;
+  ButtonId id;
   bool stableState = true;
   bool lastRawState = true;
   bool fellEdge = false;
   bool roseEdge = false;
   uint32_t lastChangeMs = 0;
+  int64_t lastChangeUs = 0;
 };
 
 class MachineController {
 public:
-  void begin();
+  void begin(BrewEventLog *eventLog);
   void update();
 
   // input queries
@@ -28,20 +55,33 @@ public:
 
   bool isManualReleased() const { return manualBtn.roseEdge; }
 
-  // output commands
-  void clickRelay();
-  void holdRelay();
-  void releaseRelay();
+  // when the pin settled for the latest debounced edge, in us
+  int64_t getLastEdgeUs() const { return lastEdgeUs; }
+
+  // output commands, false if the relay is busy stopping the machine
+  bool clickRelay();
+  bool holdRelay();
+  bool releaseRelay();
 
   // macros
-  void startPreinfusionMacro();
+  bool startPreinfusionMacro();
   bool isMacroComplete();
 
-  void stopFromPreinfusion();
+  bool stopFromPreinfusion();
+  // a stop sequence still has edges to fire
+  bool isStopping();
 
 private:
   void updateButton(DebouncedButton &btn);
 
+  // relay sequences run off an esp_timer so the edges land on time no matter
+  // what the loop is doing. starting a sequence replaces whatever was running,
+  // except a stop, cutting that short could leave the pump running
+  bool runSequence(const RelayEdge *edges, size_t count, RelaySequence kind);
+  void runDueEdges();
+  static void onRelayTimer(void *arg);
+  void printEdgeLog();
+
 #ifdef DEBUG_BUILD
   static constexpr uint8_t MANUAL_PIN = 25;
   static constexpr uint8_t TWO_CUP_PIN = 26;
@@ -55,26 +95,42 @@ private:
 #endif
 
   static constexpr ulong BUTTON_DEBOUNCE_TIME = 50;
-  static constexpr ulong RELAY_PULSE_TIME = 100;
+
+  // relay timings, in us for esp_timer
+  static constexpr uint32_t RELAY_PULSE_US = 100 * 1000;
+  // one cup press -> click to cancel that brew -> hold for preinfusion
+  static constexpr uint32_t MACRO_CLICK_DELAY_US = 200 * 1000;
+  static constexpr uint32_t MACRO_HOLD_DELAY_US = 500 * 1000;
+  // release the held relay -> click to stop
+  static constexpr uint32_t STOP_CLICK_DELAY_US = 150 * 1000;
 
   DebouncedButton manualBtn;
   DebouncedButton oneCupBtn;
   DebouncedButton twoCupBtn;
+  int64_t lastEdgeUs = 0;
+
+  BrewEventLog *events = nullptr;
+
+  static constexpr size_t MAX_SEQUENCE_EDGES = 4;
+  static constexpr size_t EDGE_LOG_SIZE = 16;
 
-  // relay state
-  bool relayActive = false;
-  bool relayLatching = false;
-  uint32_t relayReleaseTime = 0;
+  // sequence state, shared with the timer task and guarded by relayMux
+  portMUX_TYPE relayMux = portMUX_INITIALIZER_UNLOCKED;
+  esp_timer_handle_t relayTimer = nullptr;
+  RelayEdge sequence[MAX_SEQUENCE_EDGES] = {};
+  size_t sequenceLength = 0;
+  size_t sequenceIndex = 0;
+  int64_t sequenceStartUs = 0;
+  RelaySequence sequenceKind = SEQUENCE_CLICK;
 
   // start macro state
   bool macroRunning = false;
   bool macroFinished = false;
-  uint8_t macroStep = 0;
-  uint32_t macroNextActionTime = 0;
 
-  // stop macro state
-  bool stopSequenceRunning = false;
-  uint32_t stopSequenceStepTime = 0;
+  // edge timing log, filled by the timer task and printed from update()
+  RelayEdgeRecord edgeLog[EDGE_LOG_SIZE] = {};
+  uint32_t edgeLogCount = 0;
+  uint32_t edgeLogPrinted = 0;
 };
 
 #endif
@@ -0,0 +1,75 @@
+#include "ShotStats.h"
+#include <cmath>
+
+void ShotStats::reset(uint32_t start) {
+  startTime = start;
+  preinfusionEnd = 0;
+
+  flowCount = 0;
+  flowMean = 0.0f;
+  flowM2 = 0.0f;
+  peakFlow = 0.0f;
+
+  hasPrev = false;
+  prevTime = 0;
+  prevWeight = 0.0f;
+  nextMark = 0;
+  for (int i = 0; i < WEIGHT_MARK_COUNT; i++) {
+    weightAtMark[i] = 0.0f;
+  }
+}
+
+void ShotStats::addSample(uint32_t timeMs, float weight, float flowRate,
+                          bool flowing) {
+  if (timeMs < startTime)
+    return;
+
+  if (flowing) {
+    flowCount++;
+    float delta = flowRate - flowMean;
+    flowMean += delta / flowCount;
+    flowM2 += delta * (flowRate - flowMean);
+
+    if (flowRate > peakFlow)
+      peakFlow = flowRate;
+  }
+
+  // interpolate between the samples either side of each mark
+  while (nextMark < WEIGHT_MARK_COUNT) {
+    uint32_t markTime = startTime + (nextMark + 1) * WEIGHT_MARK_INTERVAL;
+    if (timeMs < markTime)
+      break;
+
+    float markWeight = weight;
+    if (hasPrev && timeMs > prevTime && prevTime <= markTime) {
+      float frac = (float)(markTime - prevTime) / (timeMs - prevTime);
+      markWeight = prevWeight + (weight - prevWeight) * frac;
+    }
+    weightAtMark[nextMark++] = markWeight;
+  }
+
+  hasPrev = true;
+  prevTime = timeMs;
+  prevWeight = weight;
+}
+
+void ShotStats::markPreinfusionEnd(uint32_t timeMs) {
+  if (preinfusionEnd == 0 && timeMs >= startTime)
+    preinfusionEnd = timeMs;
+}
+
+ShotSummary ShotStats::finalize(uint32_t endTime) const {
+  ShotSummary summary = {};
+
+  summary.peakFlow = peakFlow;
+  summary.meanFlow = flowMean;
+  summary.flowStdDev = flowCount > 1 ? sqrtf(flowM2 / (flowCount - 1)) : 0.0f;
+  summary.preinfusionTime = preinfusionEnd ? preinfusionEnd - startTime : 0;
+  summary.contactTime = endTime > startTime ? endTime - startTime : 0;
+
+  for (int i = 0; i < WEIGHT_MARK_COUNT; i++) {
+    summary.weightAtMark[i] = weightAtMark[i];
+  }
+
+  return summary;
+}
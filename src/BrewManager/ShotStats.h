@@ -0,0 +1,53 @@
+#ifndef SHOT_STATS_H
+#define SHOT_STATS_H
+
+#include <Arduino.h>
+
+static constexpr int WEIGHT_MARK_COUNT = 3;
+
+// summary of a shot, stored alongside it in the history
+struct ShotSummary {
+  float peakFlow;           // g/s
+  float meanFlow;           // g/s, from first drips to stop
+  float flowStdDev;         // g/s
+  uint32_t preinfusionTime; // ms, 0 unless weight triggered
+  uint32_t contactTime;     // ms from brew start to the stop command
+  // weight in the cup at 10s, 20s, 30s after brew start, 0 if not reached
+  float weightAtMark[WEIGHT_MARK_COUNT];
+};
+
+/**
+ * Per-shot accumulator. Every sample updates it in constant time (Welford
+ * for the flow mean/variance), so the summary is ready the moment the shot
+ * ends without going back over the data.
+ */
+class ShotStats {
+public:
+  void reset(uint32_t startTime);
+
+  // flowing = first drips have been seen, flow stats only start from there
+  void addSample(uint32_t timeMs, float weight, float flowRate, bool flowing);
+  void markPreinfusionEnd(uint32_t timeMs);
+
+  ShotSummary finalize(uint32_t endTime) const;
+
+private:
+  static constexpr uint32_t WEIGHT_MARK_INTERVAL = 10 * 1000;
+
+  uint32_t startTime = 0;
+  uint32_t preinfusionEnd = 0;
+
+  // welford
+  uint32_t flowCount = 0;
+  float flowMean = 0.0f;
+  float flowM2 = 0.0f;
+  float peakFlow = 0.0f;
+
+  bool hasPrev = false;
+  uint32_t prevTime = 0;
+  float prevWeight = 0.0f;
+  int nextMark = 0;
+  float weightAtMark[WEIGHT_MARK_COUNT] = {};
+};
+
+#endif
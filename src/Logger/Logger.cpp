@@ -0,0 +1,209 @@
+#include "Logger.h"
+
+Logger *Logger::instance = nullptr;
+
+LogEntry *Logger::reserve(uint32_t &index) {
+  index = writeIndex.load(std::memory_order_relaxed);
+
+  do {
+    // full, the oldest entries haven't been formatted yet
+    if (index - readIndex.load(std::memory_order_acquire) >= RING_SIZE) {
+      dropped++;
+      return nullptr;
+    }
+  } while (!writeIndex.compare_exchange_weak(index, index + 1,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_relaxed));
+
+  return &ring[index % RING_SIZE];
+}
+
+void Logger::pack(LogEntry &entry, size_t &used, const char *value) {
+  if (used >= LOG_SLOTS)
+    return;
+  if (!value)
+    value = "(null)";
+
+  // into the remaining slots, truncated to fit
+  char *dest = (char *)&entry.slots[used];
+  size_t room = (LOG_SLOTS - used) * sizeof(uint32_t);
+  size_t length = strnlen(value, room - 1);
+  memcpy(dest, value, length);
+  dest[length] = '\0';
+
+  used += (length + sizeof(uint32_t)) / sizeof(uint32_t);
+  setType(entry, LOG_ARG_STRING);
+}
+
+// printf one conversion at a time, the arguments come out of the slots in
+// whatever form they were packed in
+void Logger::format(const LogEntry &entry, char *out, size_t length) {
+  const char *p = entry.format;
+  size_t pos = 0;
+  size_t slot = 0;
+  uint8_t arg = 0;
+
+  while (*p && pos + 1 < length) {
+    if (*p != '%') {
+      out[pos++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      out[pos++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // flags, width and precision are kept, the length modifier is replaced
+    // to match how the argument was stored
+    char spec[16];
+    size_t specLength = 0;
+    spec[specLength++] = *p++;
+    while (*p && strchr("-+ #0123456789.", *p) &&
+           specLength < sizeof(spec) - 4)
+      spec[specLength++] = *p++;
+    while (*p && strchr("hlLzjt", *p))
+      p++;
+
+    char conversion = *p;
+    if (!conversion)
+      break;
+    p++;
+
+    size_t room = length - pos;
+    int written;
+
+    if (arg >= entry.argCount) {
+      written = snprintf(out + pos, room, "?");
+    } else {
+      LogArgType type = (LogArgType)((entry.argTypes >> (2 * arg)) & 0x3);
+      arg++;
+
+      if (type == LOG_ARG_STRING) {
+        const char *str = (const char *)&entry.slots[slot];
+        slot += (strlen(str) + sizeof(uint32_t)) / sizeof(uint32_t);
+        spec[specLength++] = 's';
+        spec[specLength] = '\0';
+        written = snprintf(out + pos, room, spec, str);
+      } else {
+        uint64_t raw = entry.slots[slot++];
+        if (type != LOG_ARG_INT32)
+          raw |= (uint64_t)entry.slots[slot++] << 32;
+
+        double d;
+        long long value;
+        if (type == LOG_ARG_DOUBLE) {
+          memcpy(&d, &raw, sizeof(d));
+          value = (long long)d;
+        } else {
+          value = type == LOG_ARG_INT32 ? (long long)(int32_t)raw
+                                        : (long long)raw;
+          d = (double)value;
+        }
+
+        if (strchr("fFeEgGaA", conversion)) {
+          spec[specLength++] = conversion;
+          spec[specLength] = '\0';
+          written = snprintf(out + pos, room, spec, d);
+        } else if (strchr("uxXo", conversion)) {
+          // unsigned 32 bit values weren't sign extended
+          unsigned long long u = type == LOG_ARG_INT32
+                                     ? (unsigned long long)(uint32_t)raw
+                                     : (unsigned long long)value;
+          spec[specLength++] = 'l';
+          spec[specLength++] = 'l';
+          spec[specLength++] = conversion;
+          spec[specLength] = '\0';
+          written = snprintf(out + pos, room, spec, u);
+        } else if (conversion == 'c') {
+          spec[specLength++] = 'c';
+          spec[specLength] = '\0';
+          written = snprintf(out + pos, room, spec, (int)value);
+        } else if (conversion == 'p') {
+          written = snprintf(out + pos, room, "0x%08lx",
+                             (unsigned long)(uint32_t)raw);
+        } else {
+          spec[specLength++] = 'l';
+          spec[specLength++] = 'l';
+          spec[specLength++] = 'd';
+          spec[specLength] = '\0';
+          written = snprintf(out + pos, room, spec, value);
+        }
+      }
+    }
+
+    if (written > 0)
+      pos += (size_t)written < room ? (size_t)written : room - 1;
+  }
+
+  // lines are stored without their newline
+  while (pos > 0 && (out[pos - 1] == '\n' || out[pos - 1] == '\r'))
+    pos--;
+  out[pos] = '\0';
+}
+
+bool Logger::drain(size_t maxEntries) {
+  for (size_t i = 0; i < maxEntries; i++) {
+    uint32_t index = readIndex.load(std::memory_order_relaxed);
+    LogEntry &entry = ring[index % RING_SIZE];
+
+    // next one isn't written yet
+    if (entry.sequence.load(std::memory_order_acquire) != index + 1)
+      return false;
+
+    char text[LINE_LENGTH];
+    format(entry, text, sizeof(text));
+    uint32_t timeMs = entry.timeMs;
+    uint8_t level = entry.level;
+
+    readIndex.store(index + 1, std::memory_order_release);
+
+#ifdef DEBUG_BUILD
+    Serial.printf("[%lu] %s\n", (unsigned long)timeMs, text);
+#endif
+
+    std::lock_guard<std::mutex> lock(historyMutex);
+    HistoryLine &line = history[historyCount % HISTORY_LINES];
+    line.sequence = ++historyCount;
+    line.timeMs = timeMs;
+    line.level = level;
+    memcpy(line.text, text, sizeof(line.text));
+  }
+
+  uint32_t index = readIndex.load(std::memory_order_relaxed);
+  return ring[index % RING_SIZE].sequence.load(std::memory_order_acquire) ==
+         index + 1;
+}
+
+uint32_t Logger::getHistory(char *out, size_t size, uint32_t since) {
+  static const char LEVEL_NAMES[] = {'E', 'W', 'I', 'D'};
+
+  std::lock_guard<std::mutex> lock(historyMutex);
+
+  uint32_t first = since + 1;
+  if (historyCount > HISTORY_LINES && first < historyCount - HISTORY_LINES + 1)
+    first = historyCount - HISTORY_LINES + 1;
+
+  size_t used = 0;
+  if (size)
+    out[0] = '\0';
+
+  uint32_t last = historyCount;
+  for (uint32_t seq = first; seq <= historyCount; seq++) {
+    const HistoryLine &line = history[(seq - 1) % HISTORY_LINES];
+    char level = line.level < sizeof(LEVEL_NAMES) ? LEVEL_NAMES[line.level]
+                                                  : '?';
+    int length = snprintf(out + used, size - used, "%lu %lu %c %s\n",
+                          (unsigned long)line.sequence,
+                          (unsigned long)line.timeMs, level, line.text);
+    if (length < 0 || used + length >= size) {
+      // only whole lines, the rest comes next time
+      out[used] = '\0';
+      last = seq - 1;
+      break;
+    }
+    used += length;
+  }
+
+  return last;
+}
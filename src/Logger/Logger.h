@@ -0,0 +1,187 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+
+// nimble already has LOG_LEVEL_*
+enum LogLevel : uint8_t { LEVEL_ERROR, LEVEL_WARN, LEVEL_INFO, LEVEL_DEBUG };
+
+// how each argument was packed, 2 bits per argument
+enum LogArgType : uint8_t {
+  LOG_ARG_INT32,
+  LOG_ARG_INT64,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STRING
+};
+
+static constexpr size_t LOG_SLOTS = 8;
+
+struct LogEntry {
+  // index + 1 once the entry is fully written
+  std::atomic<uint32_t> sequence{0};
+  uint32_t timeMs;
+  // string literal, doubles as the message id
+  const char *format;
+  uint16_t argTypes;
+  uint8_t argCount;
+  uint8_t level;
+  uint32_t slots[LOG_SLOTS];
+};
+
+/**
+ * Binary log ring.
+ *
+ * Logging a message only copies the format pointer and the raw arguments
+ * into a slot, so it's cheap enough for the notify callback and the relay
+ * timer and doesn't change their timing like a blocking Serial.printf did.
+ * Formatting happens later in drain(), which the loop only calls while
+ * there's no shot running. Formatted lines go to serial in debug builds and
+ * into a small history served on /logs.
+ *
+ * Any task can log, the reservation is a single CAS. If the ring is full the
+ * new message is dropped and counted rather than blocking.
+ */
+class Logger {
+public:
+  static Logger *getInstance() {
+    if (instance == nullptr) {
+      instance = new Logger();
+    }
+    return instance;
+  }
+
+  template <typename... Args>
+  void log(LogLevel level, const char *format, Args... args) {
+    uint32_t index;
+    LogEntry *entry = reserve(index);
+    if (!entry)
+      return;
+
+    entry->timeMs = millis();
+    entry->format = format;
+    entry->level = level;
+    entry->argTypes = 0;
+    entry->argCount = 0;
+
+    size_t used = 0;
+    packAll(*entry, used, args...);
+    entry->sequence.store(index + 1, std::memory_order_release);
+  }
+
+  // formats up to maxEntries, true if there's more waiting
+  bool drain(size_t maxEntries = DRAIN_BATCH);
+
+  // history lines after sequence `since` as text, as many whole lines as fit.
+  // returns the last sequence written so the next call carries on from there
+  uint32_t getHistory(char *out, size_t size, uint32_t since);
+  uint32_t getDroppedCount() const { return dropped.load(); }
+
+private:
+  Logger() {}
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  static Logger *instance;
+
+  static constexpr size_t RING_SIZE = 128;
+  static constexpr size_t DRAIN_BATCH = 16;
+  static constexpr size_t HISTORY_LINES = 64;
+  static constexpr size_t LINE_LENGTH = 96;
+
+  LogEntry ring[RING_SIZE];
+  std::atomic<uint32_t> writeIndex{0};
+  std::atomic<uint32_t> readIndex{0};
+  std::atomic<uint32_t> dropped{0};
+
+  struct HistoryLine {
+    uint32_t sequence;
+    uint32_t timeMs;
+    uint8_t level;
+    char text[LINE_LENGTH];
+  };
+
+  // written by drain() on the loop task, read by the web server
+  std::mutex historyMutex;
+  HistoryLine history[HISTORY_LINES] = {};
+  uint32_t historyCount = 0;
+
+  LogEntry *reserve(uint32_t &index);
+  void format(const LogEntry &entry, char *out, size_t length);
+
+  void setType(LogEntry &entry, LogArgType type) {
+    entry.argTypes |= type << (2 * entry.argCount);
+    entry.argCount++;
+  }
+
+  void packAll(LogEntry &entry, size_t &used) {}
+
+  template <typename T, typename... Rest>
+  void packAll(LogEntry &entry, size_t &used, T first, Rest... rest) {
+    pack(entry, used, first);
+    packAll(entry, used, rest...);
+  }
+
+  template <typename T>
+  typename std::enable_if<(std::is_integral<T>::value ||
+                           std::is_enum<T>::value) &&
+                          sizeof(T) <= 4>::type
+  pack(LogEntry &entry, size_t &used, T value) {
+    if (used + 1 > LOG_SLOTS)
+      return;
+    entry.slots[used++] = (uint32_t)value;
+    setType(entry, LOG_ARG_INT32);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && (sizeof(T) > 4)>::type
+  pack(LogEntry &entry, size_t &used, T value) {
+    packWide(entry, used, (uint64_t)value, LOG_ARG_INT64);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type
+  pack(LogEntry &entry, size_t &used, T value) {
+    double d = value;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    packWide(entry, used, bits, LOG_ARG_DOUBLE);
+  }
+
+  // copied now, the pointer is usually a temporary's c_str()
+  void pack(LogEntry &entry, size_t &used, const char *value);
+
+  // pointers other than strings, %p
+  template <typename T>
+  void pack(LogEntry &entry, size_t &used, const T *value) {
+    if (used + 1 > LOG_SLOTS)
+      return;
+    entry.slots[used++] = (uint32_t)(uintptr_t)value;
+    setType(entry, LOG_ARG_INT32);
+  }
+
+  void packWide(LogEntry &entry, size_t &used, uint64_t value,
+                LogArgType type) {
+    if (used + 2 > LOG_SLOTS)
+      return;
+    entry.slots[used++] = (uint32_t)value;
+    entry.slots[used++] = (uint32_t)(value >> 32);
+    setType(entry, type);
+  }
+};
+
+// never called, just lets the compiler check the format against the args
+static inline void checkLogFormat(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+static inline void checkLogFormat(const char *format, ...) {}
+
+#define LOGGER_PRINTF(level, format, ...)                                      \
+  do {                                                                         \
+    if (false)                                                                 \
+      checkLogFormat(format, ##__VA_ARGS__);                                   \
+    Logger::getInstance()->log(level, format, ##__VA_ARGS__);                  \
+  } while (0)
+
+#endif
@@ -0,0 +1,140 @@
+#include "PowerManager.h"
+#include <esp_coexist.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+
+PowerManager *PowerManager::instance = nullptr;
+
+void PowerManager::begin() {
+#if CONFIG_IDF_TARGET_ESP32S3
+  esp_pm_config_esp32s3_t config = {};
+#else
+  esp_pm_config_esp32_t config = {};
+#endif
+  config.max_freq_mhz = MAX_CPU_FREQ_MHZ;
+  config.min_freq_mhz = MIN_CPU_FREQ_MHZ;
+  config.light_sleep_enable = true;
+
+  esp_err_t err = esp_pm_configure(&config);
+  if (err != ESP_OK) {
+    // light sleep needs tickless idle, which the arduino core usually isn't
+    // built with. frequency scaling on its own still helps
+    config.light_sleep_enable = false;
+    err = esp_pm_configure(&config);
+  }
+
+  if (err != ESP_OK) {
+    WARN_PRINTF("Power management unavailable: %s\n", esp_err_to_name(err));
+    return;
+  }
+
+  lightSleep = config.light_sleep_enable;
+
+  if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "brew", &cpuLock) != ESP_OK ||
+      esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "brew", &sleepLock) !=
+          ESP_OK) {
+    ERROR_PRINTF("Failed to create power locks\n");
+    return;
+  }
+
+  configured = true;
+
+  DEBUG_PRINTF("Power management on, %d-%dMHz, light sleep %s\n",
+               MIN_CPU_FREQ_MHZ, MAX_CPU_FREQ_MHZ, lightSleep ? "on" : "off");
+}
+
+void PowerManager::boost() {
+  setRadioMode(RADIO_BREW);
+
+  // /start comes in on the web server's task, so claim the transition
+  bool expected = false;
+  if (!configured || !boosted.compare_exchange_strong(expected, true))
+    return;
+
+  int64_t start = esp_timer_get_time();
+
+  esp_pm_lock_acquire(sleepLock);
+  esp_pm_lock_acquire(cpuLock);
+
+  // the switch normally happens inside acquire, but make sure we're really
+  // there before calling it done
+  while (getCpuFrequencyMhz() < (uint32_t)MAX_CPU_FREQ_MHZ &&
+         esp_timer_get_time() - start < 10000) {
+  }
+
+  uint32_t latency = (uint32_t)(esp_timer_get_time() - start);
+  lastBoostLatencyUs = latency;
+  if (latency > maxBoostLatencyUs.load())
+    maxBoostLatencyUs = latency;
+
+  boostCount++;
+  boostStart = millis();
+}
+
+void PowerManager::relax() {
+  setRadioMode(RADIO_IDLE);
+
+  bool expected = true;
+  if (!configured || !boosted.compare_exchange_strong(expected, false))
+    return;
+
+  boostedTotal += millis() - boostStart;
+
+  esp_pm_lock_release(cpuLock);
+  esp_pm_lock_release(sleepLock);
+}
+
+uint32_t PowerManager::getBoostedTime() const {
+  if (boosted.load())
+    return boostedTotal + (millis() - boostStart);
+  return boostedTotal;
+}
+
+void PowerManager::setRadioMode(RadioMode mode) {
+  if (radioMode.exchange(mode) == mode)
+    return;
+
+  if (wifiReady.load())
+    applyRadioMode(mode);
+}
+
+void PowerManager::onWiFiConnected() {
+  wifiReady = true;
+
+  // only read when associating, so this applies from the next connection.
+  // WiFi.begin() builds a fresh config each time so check on every connect
+  wifi_config_t config;
+  if (esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK &&
+      config.sta.listen_interval != IDLE_LISTEN_INTERVAL) {
+    config.sta.listen_interval = IDLE_LISTEN_INTERVAL;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+  }
+
+  applyRadioMode(radioMode.load());
+}
+
+void PowerManager::applyRadioMode(RadioMode mode) {
+  if (mode == RADIO_BREW) {
+    esp_coex_preference_set(ESP_COEX_PREFER_BT);
+    // with ble running the driver may insist on some modem sleep, waking
+    // every DTIM is the closest we can get then
+    if (esp_wifi_set_ps(WIFI_PS_NONE) != ESP_OK)
+      esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+  } else {
+    esp_coex_preference_set(ESP_COEX_PREFER_BALANCE);
+    esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+  }
+
+  DEBUG_PRINTF("Radio mode: %s\n", getRadioModeName(mode));
+}
+
+const char *PowerManager::getRadioModeName(RadioMode mode) {
+  switch (mode) {
+  case RADIO_IDLE:
+    return "idle";
+  case RADIO_BREW:
+    return "brew";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include "debug.h"
+#include <Arduino.h>
+#include <atomic>
+#include <esp_pm.h>
+
+// radio setup follows the brew state too, see setRadioMode()
+enum RadioMode : uint8_t { RADIO_IDLE, RADIO_BREW, RADIO_MODE_COUNT };
+
+/**
+ * Dynamic frequency scaling tied to the brew state.
+ *
+ * While idle the CPU is allowed to drop to MIN_CPU_FREQ_MHZ (and light sleep
+ * if the core was built with tickless idle). Anything that might start or is
+ * running a shot takes the boost locks, which pins the CPU at full speed
+ * with light sleep off until the drips have settled.
+ *
+ * Boost latency is how long it takes from asking for full speed until the
+ * CPU is actually running at it.
+ */
+class PowerManager {
+public:
+  static PowerManager *getInstance() {
+    if (instance == nullptr) {
+      instance = new PowerManager();
+    }
+    return instance;
+  }
+
+  void begin();
+
+  // take/release the max frequency and no light sleep locks, safe to call
+  // repeatedly
+  void boost();
+  void relax();
+
+  // brewing: coexistence prefers BLE and wifi power save is off so the
+  // scale's notifications aren't held up behind web traffic. idle: balanced
+  // coexistence and modem sleep, waking every few beacons
+  void setRadioMode(RadioMode mode);
+  RadioMode getRadioMode() const { return radioMode.load(); }
+  static const char *getRadioModeName(RadioMode mode);
+  // wifi calls fail before it's up, applies the current mode once it is
+  void onWiFiConnected();
+
+  bool isConfigured() const { return configured; }
+  bool isLightSleepEnabled() const { return lightSleep; }
+  bool isBoosted() const { return boosted.load(); }
+
+  uint32_t getBoostCount() const { return boostCount.load(); }
+  uint32_t getLastBoostLatency() const { return lastBoostLatencyUs.load(); }
+  uint32_t getMaxBoostLatency() const { return maxBoostLatencyUs.load(); }
+  // total time spent boosted, including the current boost
+  uint32_t getBoostedTime() const;
+
+private:
+  PowerManager() {}
+  PowerManager(const PowerManager &) = delete;
+  PowerManager &operator=(const PowerManager &) = delete;
+
+  static PowerManager *instance;
+
+  // wifi and ble both need the 80MHz APB clock, so this is as low as we go
+  static constexpr int MIN_CPU_FREQ_MHZ = 80;
+  static constexpr int MAX_CPU_FREQ_MHZ = 240;
+
+  // modem sleep wakes every this many beacons, ~300ms at the usual 100TU
+  static constexpr uint16_t IDLE_LISTEN_INTERVAL = 3;
+
+  std::atomic<RadioMode> radioMode{RADIO_IDLE};
+  std::atomic<bool> wifiReady{false};
+  void applyRadioMode(RadioMode mode);
+
+  bool configured = false;
+  bool lightSleep = false;
+
+  esp_pm_lock_handle_t cpuLock = nullptr;
+  esp_pm_lock_handle_t sleepLock = nullptr;
+
+  std::atomic<bool> boosted{false};
+  std::atomic<uint32_t> boostCount{0};
+  std::atomic<uint32_t> lastBoostLatencyUs{0};
+  std::atomic<uint32_t> maxBoostLatencyUs{0};
+
+  uint32_t boostStart = 0;
+  uint32_t boostedTotal = 0;
+};
+
+#endif
@@ -0,0 +1,5 @@
+#include "ScaleDrivers.h"
+
+// frame tables are indexed at runtime, so they need a definition
+constexpr CommandFrame BookooDriver::FRAMES[CMD_COUNT];
+constexpr CommandFrame FelicitaDriver::FRAMES[CMD_COUNT];
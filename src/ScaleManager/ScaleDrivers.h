@@ -0,0 +1,169 @@
+#ifndef SCALE_DRIVERS_H
+#define SCALE_DRIVERS_H
+
+#include "ScalePacket.h"
+#include <string>
+
+/**
+ * One driver per scale protocol. A driver is a set of static members, the
+ * CRTP base adds the bits that are the same for every scale, so picking a
+ * driver at connect time just means picking which template instantiation we
+ * hand to NimBLE. Nothing on the per-packet path goes through a vtable.
+ *
+ * Every driver provides:
+ *   TYPE, NAME            which scale this is
+ *   NAME_PREFIX           advertised name we match on while scanning
+ *   SERVICE_UUID          service holding the weight/command characteristics
+ *   WEIGHT_UUID           notify characteristic with the weight
+ *   COMMAND_UUID          write characteristic for commands
+ *   FRAMES[CMD_COUNT]     command frames, indexed by ScaleCommand
+ *   decode()              weight notification -> WeightSample, never throws
+ */
+
+enum ScaleDriverType : uint8_t { DRIVER_NONE, DRIVER_BOOKOO, DRIVER_FELICITA };
+
+template <typename Driver> struct ScaleDriver {
+  static bool matchesName(const std::string &name) {
+    return name.rfind(Driver::NAME_PREFIX, 0) == 0;
+  }
+};
+
+constexpr CommandFrame unsupportedFrame() { return {{0}, 0}; }
+
+/**
+ * Bookoo Themis.
+ *
+ * Weight packet (20 bytes):
+ *   0-1   header 0x03 0x0B
+ *   2-4   scale timer, ms
+ *   5     unit
+ *   6     weight sign ('+' / '-')
+ *   7-9   weight, 0.01g
+ *   10    flow sign
+ *   11-12 flow, 0.01g/s
+ *   13    battery %
+ *   14-15 standby minutes
+ *   16    buzzer gear
+ *   17    flow smoothing
+ *   18    reserved
+ *   19    checksum, xor of bytes 0-18
+ *
+ * Commands are 03 0A <cmd> <data> <data> <check>, the check being the xor
+ * of the rest. Except the timer and start & tare frames, their last byte
+ * doesn't follow that but they're the ones the scale is known to accept, so
+ * they're kept byte for byte.
+ */
+constexpr CommandFrame bookooFrame(uint8_t cmd, uint8_t data0,
+                                   uint8_t data1) {
+  return {{0x03, 0x0A, cmd, data0, data1,
+           (uint8_t)(0x03 ^ 0x0A ^ cmd ^ data0 ^ data1)},
+          6};
+}
+
+struct BookooDriver : ScaleDriver<BookooDriver> {
+  static constexpr ScaleDriverType TYPE = DRIVER_BOOKOO;
+  static constexpr const char *NAME = "bookoo";
+  static constexpr const char *NAME_PREFIX = "BOOKOO";
+  static constexpr const char *SERVICE_UUID = "0FFE";
+  static constexpr const char *WEIGHT_UUID = "FF11";
+  static constexpr const char *COMMAND_UUID = "FF12";
+
+  static constexpr size_t WEIGHT_PACKET_LEN = 20;
+
+  // indexed by ScaleCommand
+  static constexpr CommandFrame FRAMES[CMD_COUNT] = {
+      bookooFrame(0x01, 0x00, 0x00),             // tare
+      {{0x03, 0x0A, 0x04, 0x00, 0x00, 0x0A}, 6}, // start timer
+      {{0x03, 0x0A, 0x05, 0x00, 0x00, 0x0D}, 6}, // stop timer
+      {{0x03, 0x0A, 0x06, 0x00, 0x00, 0x0C}, 6}, // reset timer
+      {{0x03, 0x0A, 0x07, 0x00, 0x00, 0x00}, 6}, // start & tare
+      bookooFrame(0x02, 0x00, 0x03),             // beep
+  };
+
+  static DecodeStatus decode(const uint8_t *data, size_t length,
+                             WeightSample &out) noexcept {
+    if (data == nullptr || length < WEIGHT_PACKET_LEN)
+      return DECODE_TOO_SHORT;
+
+    if (data[0] != 0x03 || data[1] != 0x0B)
+      return DECODE_BAD_HEADER;
+
+    if (xorChecksum(data, WEIGHT_PACKET_LEN - 1) != data[WEIGHT_PACKET_LEN - 1])
+      return DECODE_BAD_CHECKSUM;
+
+    out.scaleMs = (uint32_t)data[2] << 16 | (uint32_t)data[3] << 8 | data[4];
+
+    uint32_t rawWeight =
+        (uint32_t)data[7] << 16 | (uint32_t)data[8] << 8 | data[9];
+    out.weightGrams = (rawWeight / 100.0f) * (data[6] == '+' ? 1.0f : -1.0f);
+
+    return DECODE_OK;
+  }
+};
+
+/**
+ * Felicita Arc / Incline / Parallel.
+ *
+ * Weight packet (18 bytes), ascii:
+ *   0-1   header 0x01 0x02
+ *   2     weight sign ('+' / '-')
+ *   3-8   weight, 0.01g, six digits
+ *   9-10  unit
+ *   11-14 reserved
+ *   15    battery
+ *   16-17 0x0D 0x0A
+ *
+ * No timer in the packet and no checksum. Commands are a single ascii byte
+ * written to the same characteristic. There is no beep and no combined
+ * start & tare.
+ */
+constexpr CommandFrame felicitaFrame(uint8_t cmd) {
+  return {{cmd, 0, 0, 0, 0, 0}, 1};
+}
+
+struct FelicitaDriver : ScaleDriver<FelicitaDriver> {
+  static constexpr ScaleDriverType TYPE = DRIVER_FELICITA;
+  static constexpr const char *NAME = "felicita";
+  static constexpr const char *NAME_PREFIX = "FELICITA";
+  static constexpr const char *SERVICE_UUID = "FFE0";
+  static constexpr const char *WEIGHT_UUID = "FFE1";
+  static constexpr const char *COMMAND_UUID = "FFE1";
+
+  static constexpr size_t WEIGHT_PACKET_LEN = 18;
+
+  // indexed by ScaleCommand
+  static constexpr CommandFrame FRAMES[CMD_COUNT] = {
+      felicitaFrame('T'), // tare
+      felicitaFrame('R'), // start timer
+      felicitaFrame('S'), // stop timer
+      felicitaFrame('C'), // reset timer
+      unsupportedFrame(), // start & tare
+      unsupportedFrame(), // beep
+  };
+
+  static DecodeStatus decode(const uint8_t *data, size_t length,
+                             WeightSample &out) noexcept {
+    if (data == nullptr || length < WEIGHT_PACKET_LEN)
+      return DECODE_TOO_SHORT;
+
+    if (data[0] != 0x01 || data[1] != 0x02)
+      return DECODE_BAD_HEADER;
+
+    if (data[2] != '+' && data[2] != '-')
+      return DECODE_BAD_FORMAT;
+
+    uint32_t rawWeight = 0;
+    for (size_t i = 3; i < 9; i++) {
+      if (data[i] < '0' || data[i] > '9')
+        return DECODE_BAD_FORMAT;
+      rawWeight = rawWeight * 10 + (data[i] - '0');
+    }
+
+    out.scaleMs = 0;
+    out.weightGrams = (rawWeight / 100.0f) * (data[2] == '+' ? 1.0f : -1.0f);
+
+    return DECODE_OK;
+  }
+};
+
+#endif
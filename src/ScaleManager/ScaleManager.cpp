@@ -1,9 +1,8 @@
 #include "ScaleManager.h"
+#include "BootProfile.h"
+#include "Scheduler.h"
 
 ScaleManager *ScaleManager::instance = nullptr;
-NimBLEUUID ScaleManager::serviceUUID("0FFE");
-NimBLEUUID ScaleManager::commandUUID("FF12");
-NimBLEUUID ScaleManager::weightUUID("FF11");
 
 ScaleManager::ScaleManager()
     : pClient(nullptr), pScan(nullptr), commandChar(nullptr),
@@ -12,22 +11,36 @@ ScaleManager::ScaleManager()
 }
 
 void ScaleManager::onClientConnect() {
+  connecting = false;
   shouldConnect = false;
   connected = true;
+  // discovery blocks, so it happens on the loop rather than the host task
+  setupPending = true;
   lastPacketTime.store(millis());
+  BootProfile::getInstance()->mark(BOOT_SCALE_CONNECTED);
+
+  Scheduler::getInstance()->notify(EVENT_SCALE);
 }
 
 void ScaleManager::onClientConnectFail(int reason) {
+  DEBUG_PRINTF("connection failed (reason: %d)\n", reason);
+  connecting = false;
   shouldConnect = false;
   connected = false;
 
-  if (bManager->isActive())
+  // a failed direct connect means the scale is off or out of range, go find
+  // it the slow way
+  if (directConnectPending.exchange(false) || bManager->isActive())
     shouldScan = true;
+
+  Scheduler::getInstance()->notify(EVENT_SCALE);
 }
 
 void ScaleManager::onClientDisconnect(int reason) {
-  DEBUG_PRINTF("Scale Disconnected (Reason: %d)\n", reason);
+  INFO_PRINTF("Scale Disconnected (Reason: %d)\n", reason);
   cleanUpConnectionState();
+
+  Scheduler::getInstance()->notify(EVENT_SCALE);
 }
 
 void ScaleManager::onScanResult(
@@ -38,7 +51,7 @@ void ScaleManager::onScanResult(
     return;
 
   const std::string &name = advertisedDevice->getName();
-  if (name.rfind("BOOKOO", 0) == 0) {
+  if (BookooDriver::matchesName(name) || FelicitaDriver::matchesName(name)) {
     shouldScan = false;
     pScan->stop();
     {
@@ -47,13 +60,19 @@ void ScaleManager::onScanResult(
     }
     shouldConnect = true;
     DEBUG_PRINTF("scale found. scan stopped. ready to connect.\n");
+
+    Scheduler::getInstance()->notify(EVENT_SCALE);
   }
 }
 
 void ScaleManager::onScanEnd(const NimBLEScanResults &results, int reason) {
   DEBUG_PRINTF("scan finished w/ reason: %d\n", reason);
+
+  // update() restarts it if we still haven't found anything
+  Scheduler::getInstance()->notify(EVENT_SCALE);
 }
 
+template <typename Driver>
 void ScaleManager::notifyCallback(
     NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData,
     size_t length, bool isNotify) {
@@ -70,48 +89,91 @@ void ScaleManager::notifyCallback(
 
   uint32_t now = millis();
 
-  ScaleData sData = instance->parseScaleData(pData, length);
+  WeightSample sample;
+  DecodeStatus status = Driver::decode(pData, length, sample);
+  if (status != DECODE_OK) {
+    instance->rejectedPackets[status]++;
+    return;
+  }
 
-  instance->lastPacketTime.store(now);
+  instance->onWeightSample(sample, now);
+}
 
-  if (instance->tarePending) {
-    bool isTimeout = (now - instance->tareRequestTime > 1500);
-    bool isZeroed = (abs(sData.weightGrams) < 2.0f);
+void ScaleManager::onWeightSample(const WeightSample &sample, uint32_t now) {
+  // learn the packet cadence, ignoring gaps from reconnects
+  uint32_t interval = now - lastPacketTime.load();
+  if (interval < CONNECTION_TIMEOUT_MS) {
+    int32_t avg = avgPacketInterval.load();
+    avg += ((int32_t)interval - avg) / 8;
+    avgPacketInterval.store(avg);
 
-    if (isZeroed || isTimeout) {
-      instance->tarePending = false;
-    } else {
-      DEBUG_PRINTF("Ignoring old weight: %.2f while taring...\n",
-                   sData.weightGrams);
-      return;
-    }
+    std::lock_guard<std::mutex> lock(scaleMutex);
+    IntervalStats &stats =
+        intervalStats[PowerManager::getInstance()->getRadioMode()];
+    stats.count++;
+    float delta = interval - stats.mean;
+    stats.mean += delta / stats.count;
+    stats.m2 += delta * (interval - stats.mean);
+    if (interval > stats.max)
+      stats.max = interval;
+  }
+
+  lastPacketTime.store(now);
+
+  totalPackets++;
+  packetCount++;
+  if (now - packetWindowStart >= 1000) {
+    packetRate.store(packetCount * 1000.0f / (now - packetWindowStart));
+    packetCount = 0;
+    packetWindowStart = now;
   }
 
+  if (awaitingFirstPacket) {
+    awaitingFirstPacket = false;
+    connectLatency.store(now - connectRequestTime.load());
+    DEBUG_PRINTF("First weight packet %lums after connect request\n",
+                 (unsigned long)connectLatency.load());
+  }
+
+  float weight;
   float smoothedFlowRate;
+  size_t flowWindow;
 
   {
-    std::lock_guard<std::mutex> lock(instance->scaleMutex);
-
-    instance->flowBuffer[instance->bufHead].timeSecs =
-        (float)sData.milliseconds / 1000.0f;
-    instance->flowBuffer[instance->bufHead].weight = sData.weightGrams;
+    std::lock_guard<std::mutex> lock(scaleMutex);
 
-    instance->bufHead = (instance->bufHead + 1) % FLOW_WINDOW_SIZE;
+    weight = applyTare(sample, now);
 
-    if (instance->bufCount < FLOW_WINDOW_SIZE) {
-      instance->bufCount++;
+    // keep the last good weight and flow, the packet still counts as a sign
+    // of life for the cadence and loss checks
+    if (!spikeFilter.accept(weight)) {
+      spikeCount++;
+      DEBUG_PRINTF("Spike rejected: %.2fg\n", weight);
+      return;
     }
 
-    if (instance->bufCount >= 3) {
-      smoothedFlowRate = instance->calculateLinearRegressionFlow();
-    } else {
-      smoothedFlowRate = 0.0f;
+    flowBuffer[bufHead].timeMs = now;
+    flowBuffer[bufHead].weight = weight;
+
+    bufHead = (bufHead + 1) % FLOW_WINDOW_SIZE;
+
+    if (bufCount < FLOW_WINDOW_SIZE) {
+      bufCount++;
     }
+
+    smoothedFlowRate = calculateLinearRegressionFlow(flowWindow);
   }
 
-  instance->latestWeight.store(sData.weightGrams);
-  instance->latestTime.store(sData.milliseconds);
-  instance->latestFlowRate.store(smoothedFlowRate);
+  latestFlowWindow.store(flowWindow);
+
+  latestWeight.store(weight);
+  latestTime.store(sample.scaleMs);
+  latestFlowRate.store(smoothedFlowRate);
+
+  // only worth waking the loop for while a shot depends on it, in idle the
+  // next deadline picks the weight up
+  if (wantLowLatency.load())
+    Scheduler::getInstance()->notify(EVENT_SCALE);
 }
 
 bool ScaleManager::connectToServer() {
@@ -146,144 +208,271 @@ bool ScaleManager::connectToServer() {
   }
 
   if (pClient->isConnected()) {
-    // already connected...
-  } else {
-    DEBUG_PRINTF("ScaleManager: Connecting to %s...\n",
-                 targetAddress.toString().c_str());
-    if (!pClient->connect(tmp, false, false, false)) {
-      DEBUG_PRINTF("connection failed....\n");
-      return false;
-    }
+    // link's already up, it just needs setting up
+    setupPending = true;
+    return true;
   }
 
-  pClient->updateConnParams(120, 120, 0, 200);
+  DEBUG_PRINTF("ScaleManager: Connecting to %s...\n", tmp.toString().c_str());
 
-  NimBLERemoteService *pRemoteService = pClient->getService(serviceUUID);
-  if (pRemoteService == nullptr) {
-    pClient->disconnect();
-    cleanUpConnectionState();
-    return false;
+  if (directConnectPending) {
+    pClient->setConnectTimeout(DIRECT_CONNECT_TIMEOUT_MS);
+  } else {
+    pClient->setConnectTimeout(CONNECT_TIMEOUT_MS);
   }
 
-  commandChar = pRemoteService->getCharacteristic(commandUUID);
-  if (commandChar == nullptr) {
-    pClient->disconnect();
-    cleanUpConnectionState();
+  // async, the result comes back through onClientConnect/onClientConnectFail.
+  // a shot can be running on its time guard while we wait for the scale, the
+  // loop can't sit in here for seconds
+  connecting = true;
+  if (!pClient->connect(tmp, false, true, false)) {
+    DEBUG_PRINTF("couldn't start connecting\n");
+    connecting = false;
+
+    if (directConnectPending) {
+      directConnectPending = false;
+      shouldConnect = false;
+      shouldScan = true;
+    }
     return false;
   }
 
-  weightChar = pRemoteService->getCharacteristic(weightUUID);
-  if (weightChar == nullptr || !weightChar->canRead()) {
+  return true;
+}
+
+bool ScaleManager::setUpConnection() {
+  if (!pClient || !pClient->isConnected())
+    return false;
+
+  NimBLEAddress address = pClient->getPeerAddress();
+
+  // discovery and subscribing go a lot quicker on a short interval, we
+  // switch to whatever the brew state wants once we're set up
+  pClient->updateConnParams(BREW_MIN_INTERVAL, BREW_MAX_INTERVAL, BREW_LATENCY,
+                            BREW_TIMEOUT);
+  paramsLowLatency = true;
+
+  // the protocol is whichever driver's service the scale has
+  if (!attachDriver<BookooDriver>(pClient) &&
+      !attachDriver<FelicitaDriver>(pClient)) {
+    // whatever is at the cached address isn't a scale we know anymore
+    if (directConnectPending) {
+      clearCachedAddress();
+    }
     pClient->disconnect();
     cleanUpConnectionState();
     return false;
   }
 
-  if (weightChar->canNotify()) {
-    if (!weightChar->subscribe(true, notifyCallback)) {
-      pClient->disconnect();
-      cleanUpConnectionState();
-      return false;
-    }
+  lastConnectDirect = directConnectPending.load();
+  directConnectPending = false;
+
+  paramsApplied = false;
+  applyConnParams();
+
+  if (!address.equals(cachedAddress)) {
+    saveCachedAddress(address);
   }
 
   return true;
 }
 
-ScaleData ScaleManager::parseScaleData(const uint8_t *data, size_t length) {
-  if (length < 20 || data[0] != 0x03 || data[1] != 0x0B) {
-    throw std::runtime_error("Invalid data format");
+template <typename Driver>
+bool ScaleManager::attachDriver(NimBLEClient *client) {
+  NimBLERemoteService *pRemoteService =
+      client->getService(NimBLEUUID(Driver::SERVICE_UUID));
+  if (pRemoteService == nullptr)
+    return false;
+
+  NimBLERemoteCharacteristic *cmdChar =
+      pRemoteService->getCharacteristic(NimBLEUUID(Driver::COMMAND_UUID));
+  if (cmdChar == nullptr)
+    return false;
+
+  NimBLERemoteCharacteristic *wChar =
+      pRemoteService->getCharacteristic(NimBLEUUID(Driver::WEIGHT_UUID));
+  if (wChar == nullptr || !wChar->canNotify())
+    return false;
+
+  if (!wChar->subscribe(true, notifyCallback<Driver>))
+    return false;
+
+  weightChar = wChar;
+  commandFrames = Driver::FRAMES;
+  driverType = Driver::TYPE;
+  commandChar = cmdChar;
+
+  INFO_PRINTF("Scale speaks the %s protocol\n", Driver::NAME);
+  return true;
+}
+
+const char *ScaleManager::getDriverName() const {
+  switch (driverType.load()) {
+  case DRIVER_BOOKOO:
+    return BookooDriver::NAME;
+  case DRIVER_FELICITA:
+    return FelicitaDriver::NAME;
+  default:
+    return "none";
   }
+}
 
-  ScaleData result;
+void ScaleManager::setLowLatency(bool lowLatency) {
+  if (wantLowLatency.load() == lowLatency)
+    return;
 
-  // Parse milliseconds (bytes 2-4)
-  result.milliseconds =
-      (uint32_t)data[2] << 16 | (uint32_t)data[3] << 8 | data[4];
+  wantLowLatency = lowLatency;
+  applyConnParams();
+}
 
-  // Weight unit (byte 5)
-  result.weightUnit = data[5];
+void ScaleManager::applyConnParams() {
+  if (!pClient || !connected)
+    return;
 
-  // Weight value (bytes 6-9)
-  uint32_t rawWeight =
-      (uint32_t)data[7] << 16 | (uint32_t)data[8] << 8 | data[9];
-  result.weightGrams = (rawWeight / 100.0f) * (data[6] == 0x2B ? 1.0f : -1.0f);
+  bool lowLatency = wantLowLatency.load();
+  if (paramsApplied && paramsLowLatency == lowLatency)
+    return;
 
-  // Flow rate value (bytes 10-12)
-  uint16_t rawFlowRate = (uint16_t)data[11] << 8 | data[12];
-  result.flowRate = (rawFlowRate / 100.0f) * (data[10] == 0x2B ? 1.0f : -1.0f);
+  bool ok;
+  if (lowLatency) {
+    ok = pClient->updateConnParams(BREW_MIN_INTERVAL, BREW_MAX_INTERVAL,
+                                   BREW_LATENCY, BREW_TIMEOUT);
+  } else {
+    ok = pClient->updateConnParams(IDLE_MIN_INTERVAL, IDLE_MAX_INTERVAL,
+                                   IDLE_LATENCY, IDLE_TIMEOUT);
+  }
 
-  // Battery percentage (byte 13)
-  result.batteryPercent = data[13];
+  DEBUG_PRINTF("Requesting %s connection params: %s\n",
+               lowLatency ? "low latency" : "low power", ok ? "ok" : "failed");
 
-  // Standby minutes (bytes 14-15)
-  result.standbyMinutes = (uint16_t)data[14] << 8 | data[15];
+  if (ok) {
+    paramsLowLatency = lowLatency;
+    paramsApplied = true;
+  }
+}
 
-  // Buzzer gear and flow rate smoothing (bytes 16-17)
-  result.buzzerGear = data[16];
-  result.flowRateSmoothing = data[17];
+void ScaleManager::refreshConnInfo() {
+  if (!pClient || !connected)
+    return;
 
-  return result;
+  // the update is negotiated asynchronously, read back what we actually got
+  NimBLEConnInfo info = pClient->getConnInfo();
+  connInterval = info.getConnInterval();
+  connLatency = info.getConnLatency();
+  connTimeout = info.getConnTimeout();
 }
 
-void ScaleManager::printScaleData(const ScaleData &data) {
-  Serial.println(F("------ Data ------"));
-  Serial.print(F("Time (ms): "));
-  Serial.println(data.milliseconds);
+void ScaleManager::loadCachedAddress() {
+  if (!preferences.begin("scale", true)) {
+    return;
+  }
 
-  Serial.print(F("Weight (g): "));
-  Serial.println(data.weightGrams, 2);
+  String address = preferences.getString("addr", "");
+  uint8_t type = preferences.getUChar("addrType", BLE_ADDR_PUBLIC);
 
-  Serial.print(F("Flow rate (g/s): "));
-  Serial.println(data.flowRate, 2);
+  preferences.end();
 
-  Serial.print(F("Battery (%): "));
-  Serial.println(data.batteryPercent);
-  Serial.println(F("----------------------"));
+  if (address.length() > 0) {
+    cachedAddress = NimBLEAddress(std::string(address.c_str()), type);
+  }
 }
 
-float ScaleManager::calculateLinearRegressionFlow() {
-  if (bufCount < 2)
-    return 0.0f;
+void ScaleManager::saveCachedAddress(const NimBLEAddress &address) {
+  if (!preferences.begin("scale", false)) {
+    return;
+  }
 
-  float sumX = 0, sumY = 0, sumXY = 0, sumXX = 0;
+  preferences.putString("addr", address.toString().c_str());
+  preferences.putUChar("addrType", address.getType());
 
-  // find index of oldest point (where the window starts)
-  size_t oldestIndex =
-      (bufHead + FLOW_WINDOW_SIZE - bufCount) % FLOW_WINDOW_SIZE;
+  preferences.end();
 
-  float oldestTimestamp = flowBuffer[oldestIndex].timeSecs;
+  cachedAddress = address;
+}
 
-  size_t newestIndex = (bufHead + FLOW_WINDOW_SIZE - 1) % FLOW_WINDOW_SIZE;
-  // if newest index timestamp is smaller than oldest
-  if (flowBuffer[newestIndex].timeSecs < oldestTimestamp) {
-    // buffer is invalid
-    return 0.0f;
+void ScaleManager::clearCachedAddress() {
+  if (preferences.begin("scale", false)) {
+    preferences.clear();
+    preferences.end();
   }
 
-  for (size_t i = 0; i < bufCount; i++) {
-    size_t idx = (oldestIndex + i) % FLOW_WINDOW_SIZE;
+  cachedAddress = NimBLEAddress();
+}
+
+JitterStats ScaleManager::getJitterStats(RadioMode mode) {
+  std::lock_guard<std::mutex> lock(scaleMutex);
+  const IntervalStats &stats = intervalStats[mode];
+
+  JitterStats jitter;
+  jitter.count = stats.count;
+  jitter.meanMs = stats.mean;
+  jitter.stdDevMs = stats.count > 1 ? sqrtf(stats.m2 / (stats.count - 1)) : 0;
+  jitter.maxMs = stats.max;
+  return jitter;
+}
 
-    float x = flowBuffer[idx].timeSecs - oldestTimestamp;
-    float y = flowBuffer[idx].weight;
+std::string ScaleManager::getScaleAddress() {
+  std::lock_guard<std::mutex> lock(scaleMutex);
+  return targetAddress.toString();
+}
 
-    // if time delta < 0 something is wrong...
-    if (x < 0) {
-      return 0.0f;
-    }
+float ScaleManager::calculateLinearRegressionFlow(size_t &window) {
+  window = 0;
+  if (bufCount < MIN_FLOW_WINDOW)
+    return 0.0f;
+
+  // grow the window back from the newest point and keep the slope's
+  // confidence intervals intersecting (ICI rule). once a longer window
+  // disagrees with the shorter ones, the flow changed inside it and we stop
+  // there. steady flow ends up using the whole buffer, a ramp or the
+  // preinfusion release only the last few points
+  size_t newestIndex = (bufHead + FLOW_WINDOW_SIZE - 1) % FLOW_WINDOW_SIZE;
+  uint32_t newestTimestamp = flowBuffer[newestIndex].timeMs;
+  // relative to the newest point to keep the float sums small
+  float newestWeight = flowBuffer[newestIndex].weight;
+
+  float sumX = 0, sumY = 0, sumXY = 0, sumXX = 0, sumYY = 0;
+  float lower = -INFINITY, upper = INFINITY;
+  float slope = 0.0f;
+
+  for (size_t n = 1; n <= bufCount; n++) {
+    size_t idx = (newestIndex + FLOW_WINDOW_SIZE - (n - 1)) % FLOW_WINDOW_SIZE;
+
+    // receive times are monotonic, so this can't go positive
+    float x = -(float)(newestTimestamp - flowBuffer[idx].timeMs) / 1000.0f;
+    float y = flowBuffer[idx].weight - newestWeight;
 
     sumX += x;
     sumY += y;
     sumXY += (x * y);
     sumXX += (x * x);
-  }
+    sumYY += (y * y);
 
-  float denom = (bufCount * sumXX) - (sumX * sumX);
+    if (n < MIN_FLOW_WINDOW)
+      continue;
 
-  if (denom == 0)
-    return 0.0f;
+    float sxx = sumXX - sumX * sumX / n;
+    if (sxx <= 0.0f)
+      continue;
+
+    float sxy = sumXY - sumX * sumY / n;
+    float syy = sumYY - sumY * sumY / n;
+    float b = sxy / sxx;
+
+    // residual noise, floored at the scale's resolution so a perfectly
+    // clean line doesn't collapse the interval to nothing
+    float residual = fmaxf(syy - b * sxy, 0.0f);
+    float sd = fmaxf(sqrtf(residual / (n - 2)), MIN_FLOW_NOISE);
+    float se = sd / sqrtf(sxx);
 
-  float slope = ((bufCount * sumXY) - (sumX * sumY)) / denom;
+    lower = fmaxf(lower, b - FLOW_CONFIDENCE * se);
+    upper = fminf(upper, b + FLOW_CONFIDENCE * se);
+    if (lower > upper)
+      break;
+
+    slope = b;
+    window = n;
+  }
 
   // clamp to reasonable flow rate just in case
   if (slope < 0.0f)
@@ -312,18 +501,58 @@ void ScaleManager::begin() {
   scanCallbacks = new ScanCallbacks(this);
 
   pScan->setScanCallbacks(scanCallbacks);
-  pScan->setInterval(500);
-  pScan->setWindow(100);
+  pScan->setInterval(SCAN_INTERVAL_MS);
+  pScan->setWindow(SCAN_WINDOW_MS);
   pScan->setActiveScan(false);
+  // only report each advertiser once per scan
+  pScan->setDuplicateFilter(true);
+
+  loadCachedAddress();
+
+  xTaskCreatePinnedToCore(commandTaskEntry, "scaleCmd", 4096, this, 2,
+                          &commandTask, tskNO_AFFINITY);
 
   bManager = BrewManager::getInstance();
 }
 
-void ScaleManager::connectScale() { shouldScan = true; }
+void ScaleManager::connectScale() {
+  connectRequestTime = millis();
+  awaitingFirstPacket = true;
+
+  if (hasCachedAddress()) {
+    // skip the scan entirely and try the scale we saw last time
+    {
+      std::lock_guard<std::mutex> lock(scaleMutex);
+      targetAddress = cachedAddress;
+    }
+    directConnectPending = true;
+    shouldConnect = true;
+  } else {
+    directConnectPending = false;
+    shouldScan = true;
+  }
+
+  Scheduler::getInstance()->notify(EVENT_SCALE);
+}
+
+bool ScaleManager::isSignalLost() const {
+  if (!connected)
+    return true;
+
+  uint32_t timeout = LOST_PACKET_COUNT * avgPacketInterval;
+  if (timeout < MIN_LOSS_TIMEOUT_MS)
+    timeout = MIN_LOSS_TIMEOUT_MS;
+
+  return millis() - lastPacketTime.load() > timeout;
+}
 
 void ScaleManager::disconnectScale() {
   shouldConnect = false;
   shouldScan = false;
+  directConnectPending = false;
+
+  if (pClient && connecting)
+    pClient->cancelConnect();
 
   if (pClient && pClient->isConnected()) {
     pClient->disconnect();
@@ -333,6 +562,8 @@ void ScaleManager::disconnectScale() {
 }
 
 void ScaleManager::update() {
+  Scheduler *scheduler = Scheduler::getInstance();
+
   if (shouldScan) {
     if (pScan && !pScan->isScanning()) {
       if (!shouldConnect && !connected) {
@@ -342,123 +573,318 @@ void ScaleManager::update() {
     }
   }
 
-  if (shouldConnect) {
+  if (shouldConnect && !connecting) {
     static unsigned long lastConnectAttempt = 0;
-    if (millis() - lastConnectAttempt > 2000) {
+    if (millis() - lastConnectAttempt > CONNECT_RETRY_MS) {
       lastConnectAttempt = millis();
 
       if (connectToServer()) {
         shouldConnect = false;
       }
     }
+
+    if (shouldConnect)
+      scheduler->wakeAt(lastConnectAttempt + CONNECT_RETRY_MS + 1);
+  }
+
+  // link came up since the last pass
+  if (setupPending.exchange(false))
+    setUpConnection();
+
+  if (connected) {
+    // retries a request the stack refused
+    applyConnParams();
+
+    if (millis() - lastConnInfoRefresh >= CONN_INFO_REFRESH_MS) {
+      lastConnInfoRefresh = millis();
+      refreshConnInfo();
+    }
+    scheduler->wakeAt(lastConnInfoRefresh + CONN_INFO_REFRESH_MS);
   }
 
   if (connected) {
     uint32_t lastTime = lastPacketTime.load();
-    if (lastTime > 0 && (millis() - lastTime > CONNECTION_TIMEOUT_MS)) {
-      DEBUG_PRINTF("Watchdog: Connection lost.\n");
+    uint32_t timeout = constrain(WATCHDOG_PACKET_COUNT * avgPacketInterval,
+                                 MIN_WATCHDOG_TIMEOUT_MS,
+                                 (uint32_t)CONNECTION_TIMEOUT_MS);
+    if (lastTime > 0 && (millis() - lastTime > timeout)) {
+      WARN_PRINTF("Watchdog: Connection lost.\n");
 
       if (pClient)
         pClient->disconnect();
 
       cleanUpConnectionState();
+    } else if (lastTime > 0) {
+      scheduler->wakeAt(lastTime + timeout + 1);
     }
   }
 }
 
-byte TARE[6] = {0x03, 0x0a, 0x01, 0x00, 0x00, 0x08};
-byte START_TIMER[6] = {0x03, 0x0a, 0x04, 0x00, 0x00, 0x0a};
-byte STOP_TIMER[6] = {0x03, 0x0a, 0x05, 0x00, 0x00, 0x0d};
-byte RESET_TIMER[6] = {0x03, 0x0a, 0x06, 0x00, 0x00, 0x0c};
-byte START_AND_TARE[6] = {0x03, 0x0a, 0x07, 0x00, 0x00, 0x00};
-byte BEEP[6] = {0x03, 0x0a, 0x02, 0x00, 0x03, 0x08};
-
-bool ScaleManager::tare() {
-  if (commandChar == nullptr)
+bool ScaleManager::tare(CommandCallback cb) {
+  if (!queueCommand(CMD_TARE, cb))
     return false;
-  if (commandChar->writeValue(TARE)) {
-    setUpPendingTare();
-    return true;
-  } else {
-    return false;
-  }
+  setUpPendingTare();
+  return true;
 };
 
-bool ScaleManager::startTimer() {
-  if (commandChar == nullptr)
-    return false;
-  if (commandChar->writeValue(START_TIMER)) {
-    resetFlowBuffer();
-    return true;
-  } else {
+bool ScaleManager::startTimer(CommandCallback cb) {
+  if (!queueCommand(CMD_START_TIMER, cb))
     return false;
-  }
+  resetFlowBuffer();
+  return true;
 };
 
-bool ScaleManager::stopTimer() {
-  if (commandChar == nullptr)
-    return false;
-  if (commandChar->writeValue(STOP_TIMER)) {
-    return true;
-  } else {
-    return false;
-  }
+bool ScaleManager::stopTimer(CommandCallback cb) {
+  return queueCommand(CMD_STOP_TIMER, cb);
 };
 
-bool ScaleManager::resetTimer() {
-  if (commandChar == nullptr)
-    return false;
-  if (commandChar->writeValue(RESET_TIMER)) {
-    return true;
-  } else {
-    return false;
-  }
+bool ScaleManager::resetTimer(CommandCallback cb) {
+  return queueCommand(CMD_RESET_TIMER, cb);
 };
 
-bool ScaleManager::startAndTare() {
-  if (commandChar == nullptr)
-    return false;
-  if (commandChar->writeValue(START_AND_TARE)) {
+bool ScaleManager::startAndTare(CommandCallback cb) {
+  if (supportsCommand(CMD_START_AND_TARE)) {
+    if (!queueCommand(CMD_START_AND_TARE, cb))
+      return false;
     setUpPendingTare();
     return true;
-  } else {
+  }
+
+  // no combined command, the queue keeps these in order. the tare goes out
+  // even if the timer doesn't fit, so the offset has to be ready for it
+  if (!queueCommand(CMD_TARE))
     return false;
+  setUpPendingTare();
+  return queueCommand(CMD_START_TIMER, cb);
+};
+
+bool ScaleManager::beep(int count) {
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    ok &= queueCommand(CMD_BEEP);
   }
+  return ok;
 };
 
-bool ScaleManager::beep() {
-  if (commandChar == nullptr)
+bool ScaleManager::supportsCommand(ScaleCommand cmd) const {
+  const CommandFrame *frames = commandFrames.load();
+  return frames != nullptr && frames[cmd].length > 0;
+}
+
+bool ScaleManager::queueCommand(ScaleCommand cmd, CommandCallback cb) {
+  if (commandChar == nullptr || !supportsCommand(cmd))
     return false;
-  if (commandChar->writeValue(BEEP)) {
-    return true;
-  } else {
+
+  {
+    std::lock_guard<std::mutex> lock(commandMutex);
+
+    // the same command already waiting would do exactly the same thing,
+    // beeps are the exception since we want to hear each one
+    if (cmd != CMD_BEEP) {
+      for (size_t i = 0; i < cmdCount; i++) {
+        QueuedCommand &queued =
+            commandQueue[(cmdHead + i) % COMMAND_QUEUE_SIZE];
+        if (queued.cmd == cmd && queued.cb == cb) {
+          commandStats[cmd].coalesced++;
+          return true;
+        }
+      }
+    }
+
+    if (cmdCount >= COMMAND_QUEUE_SIZE) {
+      commandStats[cmd].dropped++;
+      return false;
+    }
+
+    commandQueue[(cmdHead + cmdCount) % COMMAND_QUEUE_SIZE] = {
+        .cmd = cmd, .enqueueTimeUs = (uint32_t)micros(), .cb = cb};
+    cmdCount++;
+  }
+
+  if (commandTask) {
+    xTaskNotifyGive(commandTask);
+  }
+  return true;
+}
+
+bool ScaleManager::popCommand(QueuedCommand &out) {
+  std::lock_guard<std::mutex> lock(commandMutex);
+
+  if (cmdCount == 0)
     return false;
+
+  out = commandQueue[cmdHead];
+  cmdHead = (cmdHead + 1) % COMMAND_QUEUE_SIZE;
+  cmdCount--;
+  return true;
+}
+
+void ScaleManager::sendCommand(const QueuedCommand &qc) {
+  NimBLERemoteCharacteristic *chr = commandChar.load();
+  const CommandFrame *frames = commandFrames.load();
+
+  bool ok = false;
+  if (chr != nullptr && frames != nullptr && frames[qc.cmd].length > 0) {
+    // skip the round trip for the ack if the scale lets us
+    ok = chr->writeValue(frames[qc.cmd].bytes, frames[qc.cmd].length,
+                         !chr->canWriteNoResponse());
   }
-};
+
+  uint32_t latency = (uint32_t)micros() - qc.enqueueTimeUs;
+
+  {
+    std::lock_guard<std::mutex> lock(commandMutex);
+    CommandStats &stats = commandStats[qc.cmd];
+    if (ok) {
+      stats.sent++;
+      stats.totalLatencyUs += latency;
+      if (latency > stats.maxLatencyUs)
+        stats.maxLatencyUs = latency;
+    } else {
+      stats.failed++;
+    }
+  }
+
+  if (qc.cb) {
+    qc.cb(qc.cmd, ok, latency);
+  }
+}
+
+void ScaleManager::commandTaskEntry(void *arg) {
+  ScaleManager *self = static_cast<ScaleManager *>(arg);
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    QueuedCommand qc;
+    while (self->popCommand(qc)) {
+      self->sendCommand(qc);
+
+      if (qc.cmd == CMD_BEEP) {
+        vTaskDelay(pdMS_TO_TICKS(BEEP_SPACING_MS));
+      }
+    }
+  }
+}
+
+CommandStats ScaleManager::getCommandStats(ScaleCommand cmd) {
+  std::lock_guard<std::mutex> lock(commandMutex);
+  return commandStats[cmd];
+}
+
+const char *ScaleManager::getCommandName(ScaleCommand cmd) {
+  switch (cmd) {
+  case CMD_TARE:
+    return "tare";
+  case CMD_START_TIMER:
+    return "startTimer";
+  case CMD_STOP_TIMER:
+    return "stopTimer";
+  case CMD_RESET_TIMER:
+    return "resetTimer";
+  case CMD_START_AND_TARE:
+    return "startAndTare";
+  case CMD_BEEP:
+    return "beep";
+  default:
+    return "unknown";
+  }
+}
 
 void ScaleManager::cleanUpConnectionState() {
   connected = false;
   shouldConnect = false;
+  setupPending = false;
 
-  resetFlowBuffer();
+  paramsApplied = false;
+  connInterval = 0;
+  connLatency = 0;
+  connTimeout = 0;
+  packetRate = 0.0f;
+
+  {
+    std::lock_guard<std::mutex> lock(scaleMutex);
+    resetFlowBuffer();
+    spikeFilter.reset();
+    tarePending = false;
+    tareOffset = 0.0f;
+    lastRawWeight = 0.0f;
+  }
   latestFlowRate = 0.0f;
+  latestFlowWindow = 0;
   latestWeight = 0.0f;
 
   weightChar = nullptr;
   commandChar = nullptr;
+  commandFrames = nullptr;
+  driverType = DRIVER_NONE;
+
+  {
+    // anything still queued was meant for the old connection
+    std::lock_guard<std::mutex> lock(commandMutex);
+    cmdHead = 0;
+    cmdCount = 0;
+  }
 
   if (bManager && bManager->isActive()) {
-    shouldScan = true;
+    connectScale();
   }
 }
 
 void ScaleManager::setUpPendingTare() {
   std::lock_guard<std::mutex> lock(scaleMutex);
 
-  resetFlowBuffer();
+  // whatever is on the scale right now becomes our zero. shift the flow
+  // history by the same amount so the flow estimate carries straight on
+  float newOffset = lastRawWeight;
+  float shift = tareOffset - newOffset;
 
-  latestWeight.store(0.0f);
+  for (size_t i = 0; i < bufCount; i++) {
+    size_t idx = (bufHead + FLOW_WINDOW_SIZE - 1 - i) % FLOW_WINDOW_SIZE;
+    flowBuffer[idx].weight += shift;
+  }
+  spikeFilter.shift(shift);
+
+  tareOffset = newOffset;
+  latestWeight.store(lastRawWeight - tareOffset);
 
   tarePending = true;
   tareRequestTime = millis();
-}
\ No newline at end of file
+}
+
+float ScaleManager::applyTare(const WeightSample &sample, uint32_t now) {
+  float raw = sample.weightGrams;
+
+  if (tarePending) {
+    bool bigOffset = fabs(tareOffset) >= TARE_DETECT_MIN;
+
+    // the raw reading dropped by about the amount we're already subtracting
+    float drop = lastRawWeight - raw;
+    bool weightDropped =
+        bigOffset && fabs(drop - tareOffset) < fabs(tareOffset) * 0.5f;
+
+    // start & tare also restarts the scale's timer, which is the only thing
+    // we can see when the offset is too small to notice
+    bool timerRestarted = !bigOffset && sample.scaleMs < lastScaleTime;
+
+    if (weightDropped || timerRestarted) {
+      DEBUG_PRINTF("Scale tare landed after %lums\n",
+                   (unsigned long)(now - tareRequestTime));
+      tarePending = false;
+      tareOffset = 0.0f;
+    } else if (now - tareRequestTime > TARE_TIMEOUT_MS) {
+      tarePending = false;
+      // a big offset would have been obvious when it landed, so the scale
+      // never tared and our software tare stays. a small one we can't tell
+      // apart, assume the scale did its job
+      if (fabs(tareOffset) < TARE_DETECT_MIN) {
+        tareOffset = 0.0f;
+      }
+    }
+  }
+
+  lastRawWeight = raw;
+  lastScaleTime = sample.scaleMs;
+
+  return raw - tareOffset;
+}
@@ -2,25 +2,39 @@
 #define SCALE_MANAGER_H
 
 #include "BrewManager.h"
+#include "PowerManager.h"
+#include "ScaleDrivers.h"
+#include "SpikeFilter.h"
 #include "debug.h"
 #include <NimBLEDevice.h>
+#include <Preferences.h>
 #include <atomic>
 #include <mutex>
 #include <numeric>
 
-struct ScaleData {
-  uint32_t milliseconds;
-  uint8_t weightUnit;
-  float weightGrams;
-  float flowRate;
-  uint8_t batteryPercent;
-  uint16_t standbyMinutes;
-  uint8_t buzzerGear;
-  uint8_t flowRateSmoothing;
+// called from the command task once a queued command has been written
+typedef void (*CommandCallback)(ScaleCommand cmd, bool ok, uint32_t latencyUs);
+
+struct CommandStats {
+  uint32_t sent;
+  uint32_t failed;
+  uint32_t coalesced;
+  uint32_t dropped;
+  // enqueue -> write returned
+  uint32_t totalLatencyUs;
+  uint32_t maxLatencyUs;
+};
+
+// packet inter-arrival times, over one radio mode
+struct JitterStats {
+  uint32_t count;
+  float meanMs;
+  float stdDevMs;
+  uint32_t maxMs;
 };
 
 struct FlowPoint {
-  float timeSecs;
+  uint32_t timeMs; // local receive time
   float weight;
 };
 
@@ -48,13 +62,51 @@ public:
 
   bool preScanning() const { return shouldScan; }
   bool isScanning() const { return (pScan != nullptr) && pScan->isScanning(); }
-  bool isConnecting() const { return shouldConnect; }
+  bool isConnecting() const { return shouldConnect || connecting; }
   bool isConnected() const { return connected; }
 
   float getWeight() const { return latestWeight.load(); }
   uint32_t getTime() const { return latestTime.load(); }
   float getFlowRate() const { return latestFlowRate.load(); }
+  // number of samples the last flow estimate was fitted over
+  uint8_t getFlowWindow() const { return latestFlowWindow.load(); }
   uint32_t getLastPacketTime() const { return lastPacketTime.load(); }
+  uint32_t getPacketInterval() const { return avgPacketInterval.load(); }
+  JitterStats getJitterStats(RadioMode mode);
+  // total weight packets received, lets callers spot a fresh one
+  uint32_t getPacketCount() const { return totalPackets.load(); }
+  // packets thrown away by the decoder, by reason
+  uint32_t getRejectedCount(DecodeStatus reason) const {
+    return rejectedPackets[reason].load();
+  }
+
+  // samples the spike filter kept away from the weight and flow estimate
+  uint32_t getSpikeCount() const { return spikeCount.load(); }
+
+  // true once packets stop arriving at the expected cadence, well before the
+  // watchdog gives up on the connection
+  bool isSignalLost() const;
+
+  // connection timing, from connectScale() to the first weight packet
+  uint32_t getConnectLatency() const { return connectLatency.load(); }
+  bool wasDirectConnect() const { return lastConnectDirect.load(); }
+  bool hasCachedAddress() const { return !cachedAddress.isNull(); }
+  std::string getScaleAddress();
+  // protocol of the connected scale, picked when we connect
+  ScaleDriverType getDriverType() const { return driverType.load(); }
+  const char *getDriverName() const;
+
+  // short connection interval while brewing, long interval with slave latency
+  // while idle so the link can stay up without costing much power
+  void setLowLatency(bool lowLatency);
+  bool isLowLatency() const { return wantLowLatency.load(); }
+
+  // negotiated connection parameters, in BLE units (1.25ms interval, 10ms
+  // supervision timeout)
+  uint16_t getConnInterval() const { return connInterval.load(); }
+  uint16_t getConnLatency() const { return connLatency.load(); }
+  uint16_t getSupervisionTimeout() const { return connTimeout.load(); }
+  float getPacketRate() const { return packetRate.load(); }
 
   void onClientConnect();
   void onClientConnectFail(int reason);
@@ -63,12 +115,18 @@ public:
   void onScanResult(const NimBLEAdvertisedDevice *advertisedDevice);
   void onScanEnd(const NimBLEScanResults &scanResults, int reason);
 
-  bool tare();
-  bool startTimer();
-  bool stopTimer();
-  bool resetTimer();
-  bool startAndTare();
-  bool beep();
+  // scale commands are queued and written by the command task, these only
+  // return false if the queue is full, we're not connected or the scale
+  // doesn't have that command
+  bool tare(CommandCallback cb = nullptr);
+  bool startTimer(CommandCallback cb = nullptr);
+  bool stopTimer(CommandCallback cb = nullptr);
+  bool resetTimer(CommandCallback cb = nullptr);
+  bool startAndTare(CommandCallback cb = nullptr);
+  bool beep(int count = 1);
+
+  CommandStats getCommandStats(ScaleCommand cmd);
+  static const char *getCommandName(ScaleCommand cmd);
 
 private:
   ScaleManager();
@@ -76,9 +134,54 @@ private:
   ScaleManager &operator=(const ScaleManager &) = delete;
 
   static constexpr int SCAN_TIME_MS = 5000;
+  // fallback scan when the cached address doesn't answer, busier than the
+  // old background scan but bounded by SCAN_TIME_MS
+  static constexpr uint16_t SCAN_INTERVAL_MS = 100;
+  static constexpr uint16_t SCAN_WINDOW_MS = 90;
+  // a scale that's switched on answers a direct connect quickly, don't wait
+  // long on one that isn't
+  static constexpr uint32_t DIRECT_CONNECT_TIMEOUT_MS = 1500;
+  static constexpr uint32_t CONNECT_TIMEOUT_MS = 5000;
+  // between connect attempts from update()
+  static constexpr uint32_t CONNECT_RETRY_MS = 2000;
+
+  // connection parameters, interval in 1.25ms units, timeout in 10ms units
+  // brewing: 7.5-15ms interval, every connection event
+  static constexpr uint16_t BREW_MIN_INTERVAL = 6;
+  static constexpr uint16_t BREW_MAX_INTERVAL = 12;
+  static constexpr uint16_t BREW_LATENCY = 0;
+  static constexpr uint16_t BREW_TIMEOUT = 200;
+  // idle: 200ms interval, scale may skip up to 4 events when it has nothing
+  // to send. timeout has to cover (1 + latency) * interval * 2
+  static constexpr uint16_t IDLE_MIN_INTERVAL = 160;
+  static constexpr uint16_t IDLE_MAX_INTERVAL = 160;
+  static constexpr uint16_t IDLE_LATENCY = 4;
+  static constexpr uint16_t IDLE_TIMEOUT = 400;
+
+  static constexpr uint32_t CONN_INFO_REFRESH_MS = 1000;
+
+  // command queue
+  static constexpr size_t COMMAND_QUEUE_SIZE = 8;
+  // the scale merges beeps that arrive too close together
+  static constexpr uint32_t BEEP_SPACING_MS = 150;
   static constexpr int NOTIFICATION_INTERVAL = 20;
   static constexpr int CONNECTION_TIMEOUT_MS = 2000;
 
+  // expected packet cadence until we've learnt the real one
+  static constexpr uint32_t DEFAULT_PACKET_INTERVAL_MS = 100;
+  // this many missed packets in a row and we stop trusting the weight
+  static constexpr uint32_t LOST_PACKET_COUNT = 4;
+  static constexpr uint32_t MIN_LOSS_TIMEOUT_MS = 300;
+  // the watchdog drops the connection after this many missed packets
+  static constexpr uint32_t WATCHDOG_PACKET_COUNT = 10;
+  static constexpr uint32_t MIN_WATCHDOG_TIMEOUT_MS = 1000;
+
+  // how long we wait for the scale's own tare to show up in the data
+  static constexpr uint32_t TARE_TIMEOUT_MS = 1500;
+  // offsets smaller than this can't be told apart from noise/flow when
+  // looking for the scale's tare to land
+  static constexpr float TARE_DETECT_MIN = 1.0f;
+
   static ScaleManager *instance;
 
   std::mutex scaleMutex;
@@ -86,52 +189,140 @@ private:
   std::atomic<float> latestWeight{0.0f};
   std::atomic<uint32_t> latestTime{0};
   std::atomic<float> latestFlowRate{0.0f};
+  std::atomic<uint8_t> latestFlowWindow{0};
   std::atomic<uint32_t> lastPacketTime{0};
+  std::atomic<uint32_t> avgPacketInterval{DEFAULT_PACKET_INTERVAL_MS};
+  std::atomic<uint32_t> totalPackets{0};
+  std::atomic<uint32_t> rejectedPackets[DECODE_STATUS_COUNT] = {};
+  std::atomic<uint32_t> spikeCount{0};
+
+  // welford over the packet intervals, per radio mode. guarded by scaleMutex
+  struct IntervalStats {
+    uint32_t count;
+    float mean;
+    float m2;
+    uint32_t max;
+  };
+  IntervalStats intervalStats[RADIO_MODE_COUNT] = {};
 
   // flow tracking
-  // number of samples to hold in our flow history
-  static const size_t FLOW_WINDOW_SIZE = 10;
+  // number of samples to hold in our flow history, the longest window the
+  // flow estimate will use
+  static const size_t FLOW_WINDOW_SIZE = 20;
+  static const size_t MIN_FLOW_WINDOW = 4;
+  // confidence interval half-width in standard errors when deciding how far
+  // back the current flow goes
+  static constexpr float FLOW_CONFIDENCE = 2.0f;
+  // scale resolution, lower bound on the residual noise
+  static constexpr float MIN_FLOW_NOISE = 0.02f;
   FlowPoint flowBuffer[FLOW_WINDOW_SIZE] = {};
   size_t bufHead = 0;
   size_t bufCount = 0;
+  // drops bumps before they reach the flow buffer, guarded by scaleMutex
+  SpikeFilter spikeFilter;
 
   void resetFlowBuffer();
-  float calculateLinearRegressionFlow();
+  float calculateLinearRegressionFlow(size_t &window);
 
   void setUpPendingTare();
+  float applyTare(const WeightSample &sample, uint32_t now);
 
+  // starts an async connect, setUpConnection() finishes it on the loop
   bool connectToServer();
+  bool setUpConnection();
+  template <typename Driver> bool attachDriver(NimBLEClient *client);
+
+  void applyConnParams();
 
+  struct QueuedCommand {
+    ScaleCommand cmd;
+    uint32_t enqueueTimeUs;
+    CommandCallback cb;
+  };
+
+  bool queueCommand(ScaleCommand cmd, CommandCallback cb = nullptr);
+  bool popCommand(QueuedCommand &out);
+  void sendCommand(const QueuedCommand &qc);
+  static void commandTaskEntry(void *arg);
+  void refreshConnInfo();
+
+  void loadCachedAddress();
+  void saveCachedAddress(const NimBLEAddress &address);
+  void clearCachedAddress();
+
+  // one instantiation per driver, so decoding is a direct call
+  template <typename Driver>
   static void notifyCallback(NimBLERemoteCharacteristic *pRemoteCharacteristic,
                              uint8_t *pData, size_t length, bool isNotify);
-
-  ScaleData parseScaleData(const uint8_t *data, size_t length);
-  void printScaleData(const ScaleData &data);
+  void onWeightSample(const WeightSample &sample, uint32_t now);
+  bool supportsCommand(ScaleCommand cmd) const;
 
   NimBLEClient *pClient;
   NimBLEScan *pScan;
 
   NimBLEAddress targetAddress = NimBLEAddress();
 
-  NimBLERemoteCharacteristic *commandChar;
+  // last scale we successfully talked to, persisted so we can connect
+  // straight away on wake instead of scanning
+  Preferences preferences;
+  NimBLEAddress cachedAddress = NimBLEAddress();
+  std::atomic<bool> directConnectPending{false};
+
+  // connection parameter state
+  std::atomic<bool> wantLowLatency{false};
+  bool paramsLowLatency = false;
+  bool paramsApplied = false;
+  uint32_t lastConnInfoRefresh = 0;
+  std::atomic<uint16_t> connInterval{0};
+  std::atomic<uint16_t> connLatency{0};
+  std::atomic<uint16_t> connTimeout{0};
+
+  // packets per second, counted over one second windows
+  uint32_t packetCount = 0;
+  uint32_t packetWindowStart = 0;
+  std::atomic<float> packetRate{0.0f};
+
+  std::atomic<uint32_t> connectRequestTime{0};
+  std::atomic<bool> awaitingFirstPacket{false};
+  std::atomic<uint32_t> connectLatency{0};
+  std::atomic<bool> lastConnectDirect{false};
+
+  std::atomic<ScaleDriverType> driverType{DRIVER_NONE};
+  // command frames of the connected driver, indexed by ScaleCommand
+  std::atomic<const CommandFrame *> commandFrames{nullptr};
+
+  std::atomic<NimBLERemoteCharacteristic *> commandChar;
   NimBLERemoteCharacteristic *weightChar;
 
+  // bounded command queue, guarded by commandMutex
+  std::mutex commandMutex;
+  QueuedCommand commandQueue[COMMAND_QUEUE_SIZE];
+  size_t cmdHead = 0;
+  size_t cmdCount = 0;
+  CommandStats commandStats[CMD_COUNT] = {};
+  TaskHandle_t commandTask = nullptr;
+
   ClientCallbacks *clientCallbacks;
   ScanCallbacks *scanCallbacks;
 
   std::atomic<bool> shouldScan{false};
   std::atomic<bool> shouldConnect{false};
   std::atomic<bool> connected{false};
-
-  std::atomic<bool> tarePending{false};
-  std::atomic<uint32_t> tareRequestTime{0};
+  // async connect in flight, and a link that's up but not set up yet
+  std::atomic<bool> connecting{false};
+  std::atomic<bool> setupPending{false};
+
+  // software tare, the pre-tare weight is subtracted straight away so we
+  // don't have to throw away packets while the scale catches up.
+  // guarded by scaleMutex
+  bool tarePending = false;
+  uint32_t tareRequestTime = 0;
+  float tareOffset = 0.0f;
+  float lastRawWeight = 0.0f;
+  uint32_t lastScaleTime = 0;
 
   BrewManager *bManager;
 
-  static NimBLEUUID serviceUUID;
-  static NimBLEUUID commandUUID;
-  static NimBLEUUID weightUUID;
-
   friend class ScanCallbacks;
   friend class ClientCallbacks;
 };
@@ -0,0 +1,55 @@
+#ifndef SCALE_PACKET_H
+#define SCALE_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Protocol-level types shared by the scale drivers. Kept free of Arduino and
+ * NimBLE so the decoders only depend on plain C++.
+ */
+
+enum DecodeStatus : uint8_t {
+  DECODE_OK,
+  DECODE_TOO_SHORT,
+  DECODE_BAD_HEADER,
+  DECODE_BAD_CHECKSUM,
+  // packet framed fine but the payload doesn't parse (e.g. non-digit ascii)
+  DECODE_BAD_FORMAT,
+  DECODE_STATUS_COUNT
+};
+
+struct WeightSample {
+  // scale's own timer, 0 on scales that don't report one
+  uint32_t scaleMs;
+  float weightGrams;
+};
+
+enum ScaleCommand : uint8_t {
+  CMD_TARE,
+  CMD_START_TIMER,
+  CMD_STOP_TIMER,
+  CMD_RESET_TIMER,
+  CMD_START_AND_TARE,
+  CMD_BEEP,
+  CMD_COUNT
+};
+
+static constexpr size_t MAX_COMMAND_FRAME_LEN = 6;
+
+// raw bytes written to the command characteristic, length 0 means the scale
+// has no such command
+struct CommandFrame {
+  uint8_t bytes[MAX_COMMAND_FRAME_LEN];
+  uint8_t length;
+};
+
+inline uint8_t xorChecksum(const uint8_t *data, size_t length) noexcept {
+  uint8_t sum = 0;
+  for (size_t i = 0; i < length; i++) {
+    sum ^= data[i];
+  }
+  return sum;
+}
+
+#endif
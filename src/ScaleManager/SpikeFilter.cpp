@@ -0,0 +1,84 @@
+#include "SpikeFilter.h"
+#include <math.h>
+
+void SpikeFilter::reset() {
+  head = 0;
+  count = 0;
+  hasLastGood = false;
+  lastGood = 0.0f;
+  gap = 1;
+  consecutiveRejects = 0;
+}
+
+void SpikeFilter::shift(float delta) {
+  if (hasLastGood)
+    lastGood += delta;
+}
+
+bool SpikeFilter::accept(float weight) {
+  if (!hasLastGood) {
+    hasLastGood = true;
+    lastGood = weight;
+    return true;
+  }
+
+  if (count >= MIN_INCREMENTS) {
+    float sorted[WINDOW_SIZE];
+    for (size_t i = 0; i < count; i++)
+      sorted[i] = increments[i];
+    float med = median(sorted, count);
+
+    for (size_t i = 0; i < count; i++)
+      sorted[i] = fabsf(increments[i] - med);
+    float mad = median(sorted, count);
+
+    float threshold = fmaxf(MIN_THRESHOLD, MAD_MULTIPLIER * MAD_SCALE * mad);
+    float predicted = lastGood + med * gap;
+
+    if (fabsf(weight - predicted) > threshold) {
+      if (++consecutiveRejects <= MAX_CONSECUTIVE_REJECTS) {
+        gap++;
+        return false;
+      }
+
+      // it stayed there, that's the new level. the increments across the
+      // jump would be garbage so start the history again
+      head = 0;
+      count = 0;
+      lastGood = weight;
+      gap = 1;
+      consecutiveRejects = 0;
+      return true;
+    }
+  }
+
+  push((weight - lastGood) / gap);
+  lastGood = weight;
+  gap = 1;
+  consecutiveRejects = 0;
+  return true;
+}
+
+void SpikeFilter::push(float increment) {
+  increments[head] = increment;
+  head = (head + 1) % WINDOW_SIZE;
+  if (count < WINDOW_SIZE)
+    count++;
+}
+
+// insertion sort, n is tiny
+float SpikeFilter::median(float *values, size_t n) {
+  for (size_t i = 1; i < n; i++) {
+    float v = values[i];
+    size_t j = i;
+    while (j > 0 && values[j - 1] > v) {
+      values[j] = values[j - 1];
+      j--;
+    }
+    values[j] = v;
+  }
+
+  if (n % 2 == 1)
+    return values[n / 2];
+  return (values[n / 2 - 1] + values[n / 2]) * 0.5f;
+}
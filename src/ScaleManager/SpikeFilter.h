@@ -0,0 +1,57 @@
+#ifndef SPIKE_FILTER_H
+#define SPIKE_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Causal Hampel filter on the weight stream.
+ *
+ * During a shot the weight is a ramp, not a level, so we don't compare a
+ * sample against the median weight. Instead we keep the last few increments
+ * between accepted samples and predict the next weight as
+ *   last good weight + median increment
+ * A sample further from that than a few MADs (scaled to a standard deviation)
+ * is a bump: someone touched the scale or the cup. It's dropped so it never
+ * reaches the flow regression.
+ *
+ * If the "bump" keeps going for a few packets it's a real change in level
+ * (cup placed or taken away) and we accept it and start over.
+ */
+class SpikeFilter {
+public:
+  void reset();
+
+  // false if the sample should be dropped
+  bool accept(float weight);
+
+  // move the reference along with a software tare
+  void shift(float delta);
+
+private:
+  static constexpr size_t WINDOW_SIZE = 7;
+  // don't judge anything until we have this many increments
+  static constexpr size_t MIN_INCREMENTS = 3;
+  static constexpr float MAD_MULTIPLIER = 3.0f;
+  // MAD -> standard deviation for gaussian noise
+  static constexpr float MAD_SCALE = 1.4826f;
+  // a still scale has a MAD of ~0, so anything would look like a spike. this
+  // is more than the fastest flow puts into the cup between packets
+  static constexpr float MIN_THRESHOLD = 1.0f;
+  static constexpr int MAX_CONSECUTIVE_REJECTS = 3;
+
+  float increments[WINDOW_SIZE] = {};
+  size_t head = 0;
+  size_t count = 0;
+
+  bool hasLastGood = false;
+  float lastGood = 0.0f;
+  // packets since the last accepted one
+  int gap = 1;
+  int consecutiveRejects = 0;
+
+  void push(float increment);
+  static float median(float *values, size_t n);
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "Scheduler.h"
+
+Scheduler *Scheduler::instance = nullptr;
+
+void Scheduler::begin() { events = xEventGroupCreate(); }
+
+void Scheduler::notify(EventBits_t bits) {
+  if (events)
+    xEventGroupSetBits(events, bits);
+}
+
+void IRAM_ATTR Scheduler::notifyFromISR(EventBits_t bits) {
+  if (!events)
+    return;
+
+  BaseType_t woken = pdFALSE;
+  xEventGroupSetBitsFromISR(events, bits, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+void Scheduler::wakeAt(uint32_t timeMs) {
+  if (!hasDeadline || (int32_t)(timeMs - nextDeadline) < 0) {
+    nextDeadline = timeMs;
+    hasDeadline = true;
+  }
+}
+
+EventBits_t Scheduler::wait() {
+  uint32_t waitMs = MAX_WAIT_MS;
+
+  if (hasDeadline) {
+    int32_t remaining = (int32_t)(nextDeadline - millis());
+    if (remaining <= 0) {
+      waitMs = 0;
+    } else if ((uint32_t)remaining < MAX_WAIT_MS) {
+      waitMs = remaining;
+    }
+  }
+  hasDeadline = false;
+
+  EventBits_t bits = 0;
+  if (events) {
+    bits = xEventGroupWaitBits(events, EVENT_ALL, pdTRUE, pdFALSE,
+                               pdMS_TO_TICKS(waitMs));
+  } else {
+    delay(waitMs);
+  }
+
+  if (bits & EVENT_BUTTON)
+    wakeCounts[WAKE_BUTTON]++;
+  if (bits & EVENT_SCALE)
+    wakeCounts[WAKE_SCALE]++;
+  if (bits & EVENT_COMMAND)
+    wakeCounts[WAKE_COMMAND]++;
+  if (bits & EVENT_TIMER)
+    wakeCounts[WAKE_TIMER]++;
+  if (!(bits & EVENT_ALL))
+    wakeCounts[WAKE_DEADLINE]++;
+
+  return bits;
+}
+
+const char *Scheduler::getWakeCauseName(WakeCause cause) {
+  switch (cause) {
+  case WAKE_BUTTON:
+    return "button";
+  case WAKE_SCALE:
+    return "scale";
+  case WAKE_COMMAND:
+    return "command";
+  case WAKE_TIMER:
+    return "timer";
+  case WAKE_DEADLINE:
+    return "deadline";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,79 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+// what woke the main loop up
+enum SchedulerEvent : EventBits_t {
+  EVENT_BUTTON = 1 << 0,  // button pin changed, from the ISR
+  EVENT_SCALE = 1 << 1,   // scale packet or connection change
+  EVENT_COMMAND = 1 << 2, // web request changed the brew state
+  EVENT_TIMER = 1 << 3,   // relay sequence finished
+  EVENT_ALL = EVENT_BUTTON | EVENT_SCALE | EVENT_COMMAND | EVENT_TIMER,
+};
+
+enum WakeCause : uint8_t {
+  WAKE_BUTTON,
+  WAKE_SCALE,
+  WAKE_COMMAND,
+  WAKE_TIMER,
+  WAKE_DEADLINE,
+  WAKE_CAUSE_COUNT
+};
+
+/**
+ * Puts the main loop to sleep until there's something to do.
+ *
+ * Anything running on another task or in an ISR sets an event bit. Each
+ * update() in the loop asks for the next time it needs to run (wifi check,
+ * websocket push, activity timeout...) with wakeAt(), and wait() blocks on
+ * the event group until an event arrives or the earliest of those deadlines
+ * is reached.
+ */
+class Scheduler {
+public:
+  static Scheduler *getInstance() {
+    if (instance == nullptr) {
+      instance = new Scheduler();
+    }
+    return instance;
+  }
+
+  void begin();
+
+  void notify(EventBits_t events);
+  void notifyFromISR(EventBits_t events);
+
+  // loop task only, deadlines are cleared on every wait()
+  void wakeAt(uint32_t timeMs);
+  void wakeIn(uint32_t delayMs) { wakeAt(millis() + delayMs); }
+
+  EventBits_t wait();
+
+  uint32_t getWakeCount(WakeCause cause) const {
+    return wakeCounts[cause].load();
+  }
+  static const char *getWakeCauseName(WakeCause cause);
+
+private:
+  Scheduler() {}
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  static Scheduler *instance;
+
+  // nothing asked for a deadline, still come round now and then
+  static constexpr uint32_t MAX_WAIT_MS = 1000;
+
+  EventGroupHandle_t events = nullptr;
+
+  bool hasDeadline = false;
+  uint32_t nextDeadline = 0;
+
+  std::atomic<uint32_t> wakeCounts[WAKE_CAUSE_COUNT] = {};
+};
+
+#endif
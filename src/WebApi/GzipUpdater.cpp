@@ -0,0 +1,270 @@
+#include "GzipUpdater.h"
+#include "debug.h"
+#include <Update.h>
+#include <esp_rom_crc.h>
+
+bool GzipUpdater::begin(const char *md5) {
+  if (isRunning()) {
+    error = "update already running";
+    return false;
+  }
+
+  release();
+  error = nullptr;
+  headerCount = 0;
+  flags = 0;
+  skipRemaining = 0;
+  tailCount = 0;
+  windowOffset = 0;
+  crc = 0;
+  compressedSize = 0;
+  imageSize = 0;
+  startTime = millis();
+  endTime = startTime;
+
+  // ~43KB between them, only while an update is running
+  inflater = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  window = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+  if (!inflater || !window) {
+    stage = STAGE_HEADER;
+    fail("out of memory");
+    return false;
+  }
+  tinfl_init(inflater);
+
+  // we don't know the decompressed size until the trailer, Update checks it
+  // fits in the slot as it goes
+  if (!Update.begin(UPDATE_SIZE_UNKNOWN)) {
+    stage = STAGE_HEADER;
+    fail(Update.errorString());
+    return false;
+  }
+
+  stage = STAGE_HEADER;
+
+  if (md5 && *md5 && !Update.setMD5(md5)) {
+    fail("invalid md5");
+    return false;
+  }
+
+  return true;
+}
+
+bool GzipUpdater::write(const uint8_t *data, size_t length) {
+  if (!isRunning())
+    return false;
+
+  compressedSize += length;
+  keepTail(data, length);
+
+  while (length > 0 && stage != STAGE_FAILED) {
+    size_t used;
+    if (stage < STAGE_BODY) {
+      used = parseHeader(data, length);
+    } else if (stage == STAGE_BODY) {
+      used = inflate(data, length);
+    } else {
+      // trailer, keepTail has it
+      used = length;
+    }
+    data += used;
+    length -= used;
+  }
+
+  return stage != STAGE_FAILED;
+}
+
+bool GzipUpdater::end() {
+  if (!isRunning())
+    return false;
+
+  if (stage != STAGE_TRAILER || tailCount < TRAILER_SIZE) {
+    fail("image was cut short");
+    return false;
+  }
+
+  uint32_t expectedCrc = tail[0] | (tail[1] << 8) | (tail[2] << 16) |
+                         ((uint32_t)tail[3] << 24);
+  uint32_t expectedSize = tail[4] | (tail[5] << 8) | (tail[6] << 16) |
+                          ((uint32_t)tail[7] << 24);
+
+  if (crc != expectedCrc) {
+    fail("CRC mismatch");
+    return false;
+  }
+
+  // gzip only keeps the size mod 2^32, plenty for a flash slot
+  if ((uint32_t)imageSize != expectedSize) {
+    fail("size mismatch");
+    return false;
+  }
+
+  // checks the md5 and the image's own hash, then marks the slot to boot
+  if (!Update.end(true)) {
+    fail(Update.errorString());
+    return false;
+  }
+
+  endTime = millis();
+  release();
+  stage = STAGE_IDLE;
+
+  INFO_PRINTF("OTA: %u bytes -> %u bytes in %lums\n", (unsigned)compressedSize,
+              (unsigned)imageSize, (unsigned long)getDuration());
+  return true;
+}
+
+void GzipUpdater::abort() {
+  if (isRunning())
+    fail("aborted");
+  stage = STAGE_IDLE;
+}
+
+size_t GzipUpdater::parseHeader(const uint8_t *data, size_t length) {
+  size_t i = 0;
+
+  while (i < length && stage < STAGE_BODY) {
+    uint8_t b = data[i++];
+
+    switch (stage) {
+    case STAGE_HEADER:
+      header[headerCount++] = b;
+      if (headerCount < HEADER_SIZE)
+        break;
+
+      // magic, then the method which is always deflate
+      if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8) {
+        fail("not a gzip file");
+        return length;
+      }
+      flags = header[3];
+      nextHeaderStage();
+      break;
+
+    case STAGE_EXTRA_LENGTH:
+      skipRemaining |= (size_t)b << (8 * headerCount++);
+      if (headerCount == 2) {
+        stage = STAGE_EXTRA;
+        if (skipRemaining == 0)
+          nextHeaderStage();
+      }
+      break;
+
+    case STAGE_EXTRA:
+    case STAGE_HEADER_CRC:
+      if (--skipRemaining == 0)
+        nextHeaderStage();
+      break;
+
+    case STAGE_NAME:
+    case STAGE_COMMENT:
+      // zero terminated
+      if (b == 0)
+        nextHeaderStage();
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  return i;
+}
+
+// optional header fields come in a fixed order, skip to the next one that's
+// present or to the compressed data
+void GzipUpdater::nextHeaderStage() {
+  headerCount = 0;
+  skipRemaining = 0;
+
+  if (stage < STAGE_EXTRA_LENGTH && (flags & FLAG_EXTRA)) {
+    stage = STAGE_EXTRA_LENGTH;
+  } else if (stage < STAGE_NAME && (flags & FLAG_NAME)) {
+    stage = STAGE_NAME;
+  } else if (stage < STAGE_COMMENT && (flags & FLAG_COMMENT)) {
+    stage = STAGE_COMMENT;
+  } else if (stage < STAGE_HEADER_CRC && (flags & FLAG_HCRC)) {
+    stage = STAGE_HEADER_CRC;
+    skipRemaining = 2;
+  } else {
+    stage = STAGE_BODY;
+  }
+}
+
+size_t GzipUpdater::inflate(const uint8_t *data, size_t length) {
+  size_t consumed = 0;
+
+  while (true) {
+    size_t inBytes = length - consumed;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - windowOffset;
+
+    // the window doubles as the output buffer, tinfl wraps around it
+    tinfl_status status =
+        tinfl_decompress(inflater, data + consumed, &inBytes, window,
+                         window + windowOffset, &outBytes,
+                         TINFL_FLAG_HAS_MORE_INPUT);
+    consumed += inBytes;
+
+    if (outBytes > 0) {
+      uint8_t *out = window + windowOffset;
+      crc = esp_rom_crc32_le(crc, out, outBytes);
+
+      if (Update.write(out, outBytes) != outBytes) {
+        fail(Update.errorString());
+        return length;
+      }
+
+      imageSize += outBytes;
+      windowOffset = (windowOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (status == TINFL_STATUS_DONE) {
+      stage = STAGE_TRAILER;
+      return consumed;
+    }
+
+    if (status < 0) {
+      fail("corrupt gzip data");
+      return length;
+    }
+
+    // everything we were given is in the inflater, wait for the next chunk
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT)
+      return length;
+  }
+}
+
+void GzipUpdater::keepTail(const uint8_t *data, size_t length) {
+  if (length >= TRAILER_SIZE) {
+    memcpy(tail, data + length - TRAILER_SIZE, TRAILER_SIZE);
+    tailCount = TRAILER_SIZE;
+    return;
+  }
+
+  size_t keep = TRAILER_SIZE - length;
+  if (keep > tailCount)
+    keep = tailCount;
+
+  memmove(tail, tail + tailCount - keep, keep);
+  memcpy(tail + keep, data, length);
+  tailCount = keep + length;
+}
+
+void GzipUpdater::fail(const char *reason) {
+  error = reason;
+  stage = STAGE_FAILED;
+  endTime = millis();
+
+  // leaves the running slot as the boot partition
+  Update.abort();
+  release();
+
+  ERROR_PRINTF("OTA failed: %s\n", reason);
+}
+
+void GzipUpdater::release() {
+  free(inflater);
+  free(window);
+  inflater = nullptr;
+  window = nullptr;
+}
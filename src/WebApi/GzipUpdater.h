@@ -0,0 +1,96 @@
+#ifndef GZIP_UPDATER_H
+#define GZIP_UPDATER_H
+
+#include <Arduino.h>
+
+#if CONFIG_IDF_TARGET_ESP32S3
+#include <esp32s3/rom/miniz.h>
+#else
+#include <esp32/rom/miniz.h>
+#endif
+
+/**
+ * Streams a gzipped firmware image into the inactive OTA slot.
+ *
+ * Chunks come in as they arrive over http and go straight through the
+ * inflater in the ROM into Update, so nothing bigger than the 32KB deflate
+ * window is ever held in memory. The decompressed image is checked three
+ * ways: the gzip CRC32 and length from the trailer, an optional MD5 the
+ * client sends along, and the SHA256 esptool appends to every app image,
+ * which Update checks when it's finished.
+ */
+class GzipUpdater {
+public:
+  ~GzipUpdater() { release(); }
+
+  // md5 of the decompressed image, optional
+  bool begin(const char *md5 = nullptr);
+  bool write(const uint8_t *data, size_t length);
+  // only true once the image is verified and set to boot next
+  bool end();
+  void abort();
+
+  bool isRunning() const {
+    return stage != STAGE_IDLE && stage != STAGE_FAILED;
+  }
+  const char *getError() const { return error; }
+
+  size_t getCompressedSize() const { return compressedSize; }
+  size_t getImageSize() const { return imageSize; }
+  uint32_t getDuration() const { return endTime - startTime; }
+
+private:
+  enum Stage : uint8_t {
+    STAGE_IDLE,
+    STAGE_HEADER,
+    STAGE_EXTRA_LENGTH,
+    STAGE_EXTRA,
+    STAGE_NAME,
+    STAGE_COMMENT,
+    STAGE_HEADER_CRC,
+    STAGE_BODY,
+    STAGE_TRAILER,
+    STAGE_FAILED
+  };
+
+  // gzip header flags
+  static constexpr uint8_t FLAG_HCRC = 0x02;
+  static constexpr uint8_t FLAG_EXTRA = 0x04;
+  static constexpr uint8_t FLAG_NAME = 0x08;
+  static constexpr uint8_t FLAG_COMMENT = 0x10;
+
+  static constexpr size_t HEADER_SIZE = 10;
+  static constexpr size_t TRAILER_SIZE = 8;
+
+  Stage stage = STAGE_IDLE;
+  const char *error = nullptr;
+
+  tinfl_decompressor *inflater = nullptr;
+  uint8_t *window = nullptr;
+  size_t windowOffset = 0;
+
+  uint8_t header[HEADER_SIZE] = {};
+  size_t headerCount = 0;
+  uint8_t flags = 0;
+  size_t skipRemaining = 0;
+
+  // the last bytes of the stream, the trailer is always at the very end no
+  // matter how far ahead the inflater read
+  uint8_t tail[TRAILER_SIZE] = {};
+  size_t tailCount = 0;
+
+  uint32_t crc = 0;
+  size_t compressedSize = 0;
+  size_t imageSize = 0;
+  uint32_t startTime = 0;
+  uint32_t endTime = 0;
+
+  size_t parseHeader(const uint8_t *data, size_t length);
+  size_t inflate(const uint8_t *data, size_t length);
+  void nextHeaderStage();
+  void keepTail(const uint8_t *data, size_t length);
+  void fail(const char *reason);
+  void release();
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "HeapStats.h"
+#include <atomic>
+
+HeapStats *HeapStats::instance = nullptr;
+
+static std::atomic<uint32_t> allocationCount{0};
+
+// the real ones, renamed by the linker
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+
+extern "C" void *IRAM_ATTR __wrap_malloc(size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_calloc(size_t count, size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __real_calloc(count, size);
+}
+
+extern "C" void *IRAM_ATTR __wrap_realloc(void *ptr, size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+uint32_t HeapStats::getAllocationCount() {
+  return allocationCount.load(std::memory_order_relaxed);
+}
+
+EndpointStats *HeapStats::addEndpoint(const char *method, const char *path) {
+  if (endpointCount >= MAX_ENDPOINTS)
+    return nullptr;
+
+  EndpointStats *stats = &endpoints[endpointCount++];
+  stats->method = method;
+  stats->path = path;
+  stats->minLargestBlock = UINT32_MAX;
+  return stats;
+}
+
+HeapStats::Probe HeapStats::start() const {
+  Probe probe;
+  probe.freeHeap = ESP.getFreeHeap();
+  probe.allocations = getAllocationCount();
+  return probe;
+}
+
+void HeapStats::finish(EndpointStats *stats, const Probe &probe) {
+  uint32_t allocations = getAllocationCount() - probe.allocations;
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+
+  if (!stats)
+    return;
+
+  stats->requests++;
+  stats->allocations += allocations;
+  if (allocations > stats->maxAllocations)
+    stats->maxAllocations = allocations;
+  uint32_t held = probe.freeHeap > freeHeap ? probe.freeHeap - freeHeap : 0;
+  if (held > stats->maxHeapHeld)
+    stats->maxHeapHeld = held;
+  if (largestBlock < stats->minLargestBlock)
+    stats->minLargestBlock = largestBlock;
+}
@@ -0,0 +1,70 @@
+#ifndef HEAP_STATS_H
+#define HEAP_STATS_H
+
+#include <Arduino.h>
+
+struct EndpointStats {
+  const char *method;
+  const char *path;
+  uint32_t requests;
+  // summed over every request, and the worst single one
+  uint32_t allocations;
+  uint32_t maxAllocations;
+  // free heap before the handler minus after, mostly the response body
+  // that's still waiting to go out
+  uint32_t maxHeapHeld;
+  uint32_t minLargestBlock;
+};
+
+/**
+ * Heap use per http endpoint, so it's obvious which handler is chopping the
+ * heap up.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (-Wl,--wrap in platformio.ini), which catches the String and new
+ * calls inside the libraries too. The count is global, so anything the BLE
+ * or WiFi tasks allocate while a handler runs gets blamed on that handler,
+ * it's a rough number but it's the trend that matters.
+ */
+class HeapStats {
+public:
+  struct Probe {
+    uint32_t allocations;
+    uint32_t freeHeap;
+  };
+
+  // null once the table's full
+  EndpointStats *addEndpoint(const char *method, const char *path);
+
+  Probe start() const;
+  void finish(EndpointStats *stats, const Probe &probe);
+
+  size_t getEndpointCount() const { return endpointCount; }
+  const EndpointStats &getEndpoint(size_t index) const {
+    return endpoints[index];
+  }
+
+  // every malloc, calloc and realloc since boot
+  static uint32_t getAllocationCount();
+
+  static HeapStats *getInstance() {
+    if (!instance) {
+      instance = new HeapStats();
+    }
+    return instance;
+  }
+
+private:
+  HeapStats() = default;
+  HeapStats(const HeapStats &) = delete;
+  HeapStats &operator=(const HeapStats &) = delete;
+
+  static HeapStats *instance;
+
+  static constexpr size_t MAX_ENDPOINTS = 24;
+
+  EndpointStats endpoints[MAX_ENDPOINTS] = {};
+  size_t endpointCount = 0;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "ResponseBuffer.h"
+#include <stdio.h>
+#include <string.h>
+
+ResponseBuffer::ResponseBuffer(char *data, size_t capacity)
+    : data(data), capacity(capacity) {
+  reset();
+}
+
+void ResponseBuffer::reset() {
+  used = 0;
+  overflowed = false;
+  if (capacity)
+    data[0] = '\0';
+}
+
+void ResponseBuffer::append(char c) {
+  if (overflowed)
+    return;
+
+  // always leave room for the terminator
+  if (used + 1 >= capacity) {
+    overflowed = true;
+    return;
+  }
+  data[used++] = c;
+  data[used] = '\0';
+}
+
+void ResponseBuffer::print(const char *text) {
+  if (overflowed)
+    return;
+
+  size_t length = strlen(text);
+  if (used + length >= capacity) {
+    overflowed = true;
+    return;
+  }
+  memcpy(data + used, text, length + 1);
+  used += length;
+}
+
+void ResponseBuffer::printf(const char *format, ...) {
+  if (overflowed)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(data + used, capacity - used, format, args);
+  va_end(args);
+
+  if (length < 0 || used + length >= capacity) {
+    // vsnprintf left a truncated piece behind, drop it
+    data[used] = '\0';
+    overflowed = true;
+    return;
+  }
+  used += length;
+}
+
+void ResponseBuffer::printString(const char *text) {
+  append('"');
+  for (const char *p = text; *p; p++) {
+    char c = *p;
+    if (c == '"' || c == '\\') {
+      append('\\');
+      append(c);
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      print(escaped);
+    } else {
+      append(c);
+    }
+  }
+  append('"');
+}
+
+void ResponseBuffer::printObject(const char *key, const char *value) {
+  print("{");
+  printString(key);
+  print(": ");
+  printString(value);
+  print("}");
+}
@@ -0,0 +1,51 @@
+#ifndef RESPONSE_BUFFER_H
+#define RESPONSE_BUFFER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/**
+ * Response body built in a fixed block of memory.
+ *
+ * Growing a String with += reallocs every few appends, and on a heap that
+ * also holds BLE, WiFi and lwip buffers that's what chops it up until a big
+ * enough block can't be found. Handlers print into one of these instead and
+ * the finished body is handed to the server in a single allocation of the
+ * exact size.
+ *
+ * Running out of room doesn't write past the end, it marks the body as
+ * overflowed and ignores everything after, so the caller can send an error
+ * instead of broken json.
+ */
+class ResponseBuffer {
+public:
+  // stack buffer for error and message bodies
+  static constexpr size_t SMALL_BODY_SIZE = 160;
+
+  ResponseBuffer(char *data, size_t capacity);
+
+  void reset();
+
+  void print(const char *text);
+  void printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  // quoted and escaped json string
+  void printString(const char *text);
+  void printBool(bool value) { print(value ? "true" : "false"); }
+  // {"key": "value"}, what error and message responses look like
+  void printObject(const char *key, const char *value);
+
+  const char *c_str() const { return data; }
+  size_t length() const { return used; }
+  size_t getCapacity() const { return capacity; }
+  bool isOverflowed() const { return overflowed; }
+
+private:
+  char *data;
+  size_t capacity;
+  size_t used = 0;
+  bool overflowed = false;
+
+  void append(char c);
+};
+
+#endif
@@ -1,8 +1,10 @@
 #include "WebApi.h"
+#include "BootProfile.h"
 #include "credentials.h"
 #include "debug.h"
 #include <Arduino.h>
 #include <ArduinoOTA.h>
+#include <Preferences.h>
 #include <WiFi.h>
 #include <cstdint>
 
@@ -11,22 +13,101 @@ WebAPI *WebAPI::instance = nullptr;
 WebAPI::WebAPI() : server(80), ws("/ws"), lastWebSocketUpdate(0) {}
 
 void WebAPI::setupWiFi() {
+  // the credentials are compiled in, no need to write them to flash on every
+  // begin()
+  WiFi.persistent(false);
   WiFi.mode(WIFI_STA);
   WiFi.setHostname("autobru");
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
 
-  while (WiFi.waitForConnectResult() != WL_CONNECTED) {
-    DEBUG_PRINTF("Attempting reconnect in 5...\n");
-    delay(5000);
-    WiFi.disconnect();
+  // don't block boot on the network, everything that needs it happens once
+  // we actually have an IP
+  WiFi.onEvent(
+      [this](arduino_event_id_t event, arduino_event_info_t info) {
+        onWiFiConnected();
+      },
+      ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  WiFi.onEvent(
+      [this](arduino_event_id_t event, arduino_event_info_t info) {
+        if (fastConnectPending) {
+          fastConnectPending = false;
+          fastConnectFailed = true;
+        }
+      },
+      ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+
+#ifdef WIFI_STATIC_IP
+  IPAddress ip, gateway, subnet, dns;
+  if (ip.fromString(WIFI_STATIC_IP) && gateway.fromString(WIFI_GATEWAY) &&
+      subnet.fromString(WIFI_SUBNET) && dns.fromString(WIFI_DNS)) {
+    WiFi.config(ip, gateway, subnet, dns);
+    staticIP = true;
+  }
+#endif
+
+  uint8_t bssid[6];
+  uint8_t channel;
+  if (loadWiFiCache(bssid, channel)) {
+    // same access point as last time, skips the scan across every channel
+    fastConnect = true;
+    fastConnectPending = true;
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD, channel, bssid);
+  } else {
     WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
   }
+}
 
-  if (WiFi.status() == WL_CONNECTED) {
-    DEBUG_PRINTF("Connected to WiFi, IP: %s\n", WiFi.localIP().toString());
-    configTime(0, 0, "pool.ntp.org");
-    bManager->syncTimezone();
-  }
+void WebAPI::onWiFiConnected() {
+  fastConnectPending = false;
+  BootProfile::getInstance()->mark(BOOT_WIFI_CONNECTED);
+  INFO_PRINTF("Connected to WiFi, IP: %s\n",
+              WiFi.localIP().toString().c_str());
+
+  configTime(0, 0, "pool.ntp.org");
+  bManager->syncTimezone();
+  pManager->onWiFiConnected();
+
+  saveWiFiCache(WiFi.BSSID(), WiFi.channel());
+}
+
+bool WebAPI::loadWiFiCache(uint8_t *bssid, uint8_t &channel) {
+  Preferences preferences;
+  if (!preferences.begin("wifi", true))
+    return false;
+
+  bool ok = preferences.getBytes("bssid", bssid, 6) == 6;
+  channel = preferences.getUChar("channel", 0);
+  preferences.end();
+
+  return ok && channel > 0;
+}
+
+void WebAPI::saveWiFiCache(const uint8_t *bssid, int32_t channel) {
+  if (!bssid || channel <= 0)
+    return;
+
+  // only write when the AP actually changed, this runs on every reconnect
+  uint8_t cachedBssid[6];
+  uint8_t cachedChannel;
+  if (loadWiFiCache(cachedBssid, cachedChannel) &&
+      memcmp(cachedBssid, bssid, 6) == 0 && cachedChannel == channel)
+    return;
+
+  Preferences preferences;
+  if (!preferences.begin("wifi", false))
+    return;
+
+  preferences.putBytes("bssid", bssid, 6);
+  preferences.putUChar("channel", channel);
+  preferences.end();
+}
+
+void WebAPI::clearWiFiCache() {
+  Preferences preferences;
+  if (!preferences.begin("wifi", false))
+    return;
+
+  preferences.clear();
+  preferences.end();
 }
 
 void WebAPI::setupWebSocket() {
@@ -35,10 +116,10 @@ void WebAPI::setupWebSocket() {
     switch (type) {
     case WS_EVT_CONNECT:
       if (ws.count() > MAX_WS_CLIENTS) {
-        DEBUG_PRINTF("count is %d max clients hit, cleaning up clients\n",
-                     ws.count());
+        DEBUG_PRINTF("count is %u max clients hit, cleaning up clients\n",
+                     (unsigned)ws.count());
         ws.cleanupClients(MAX_WS_CLIENTS);
-        DEBUG_PRINTF("count is %d after clearing\n", ws.count());
+        DEBUG_PRINTF("count is %u after clearing\n", (unsigned)ws.count());
       }
       DEBUG_PRINTF("WebSocket client #%u connected from %s\n", client->id(),
                    client->remoteIP().toString().c_str());
@@ -64,334 +145,759 @@ void WebAPI::setupWebSocket() {
   server.addHandler(&ws);
 }
 
+ArRequestHandlerFunction WebAPI::track(const char *method, const char *path,
+                                       ArRequestHandlerFunction handler) {
+  EndpointStats *stats = heapStats->addEndpoint(method, path);
+
+  return [this, stats, handler](AsyncWebServerRequest *request) {
+    HeapStats::Probe probe = heapStats->start();
+    handler(request);
+    heapStats->finish(stats, probe);
+  };
+}
+
+void WebAPI::on(const char *path, WebRequestMethodComposite method,
+                ArRequestHandlerFunction handler,
+                ArUploadHandlerFunction upload) {
+  const char *methodName = method == HTTP_GET    ? "GET"
+                           : method == HTTP_POST ? "POST"
+                                                 : "ANY";
+  server.on(path, method, track(methodName, path, handler), upload);
+}
+
+ResponseBuffer &WebAPI::beginBody() {
+  body.reset();
+  return body;
+}
+
+void WebAPI::sendBody(AsyncWebServerRequest *request, int code,
+                      const char *type, const char *etag) {
+  if (body.isOverflowed()) {
+    ERROR_PRINTF("Response to %s didn't fit in %u bytes\n",
+                 request->url().c_str(), (unsigned)body.getCapacity());
+    sendError(request, 500, "Response too large");
+    return;
+  }
+
+  // copied out once at the exact size, the arena's free again after this
+  AsyncWebServerResponse *response =
+      request->beginResponse(code, type, body.c_str());
+  if (etag) {
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+  }
+  request->send(response);
+}
+
+bool WebAPI::sendNotModified(AsyncWebServerRequest *request,
+                             const char *etag) {
+  const AsyncWebHeader *header = request->getHeader("If-None-Match");
+  if (!header)
+    return false;
+
+  // can be a list, and the quotes keep "4" from matching "42"
+  const char *match = header->value().c_str();
+  if (strcmp(match, "*") != 0 && !strstr(match, etag))
+    return false;
+
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+  return true;
+}
+
+static void formatETag(char *out, size_t size, uint32_t version) {
+  snprintf(out, size, "\"%lu\"", (unsigned long)version);
+}
+
+void WebAPI::sendError(AsyncWebServerRequest *request, int code,
+                       const char *message) {
+  char data[ResponseBuffer::SMALL_BODY_SIZE];
+  ResponseBuffer error(data, sizeof(data));
+  error.printObject("error", message);
+  request->send(code, "application/json", error.c_str());
+}
+
+void WebAPI::sendMessage(AsyncWebServerRequest *request, const char *message) {
+  char data[ResponseBuffer::SMALL_BODY_SIZE];
+  ResponseBuffer response(data, sizeof(data));
+  response.printObject("message", message);
+  request->send(200, "application/json", response.c_str());
+}
+
+static void printShot(ResponseBuffer &json, const Shot &shot) {
+  const ShotSummary &summary = shot.summary;
+
+  json.printf("{\"id\":%lu,\"targetWeight\":%.2f,\"finalWeight\":%.2f"
+              ",\"lastFlowRate\":%.2f,\"stopWeight\":%.2f"
+              ",\"firstDripTime\":%lu,\"actuationDelay\":%lu"
+              ",\"drippage\":%.2f",
+              (unsigned long)shot.id, shot.targetWeight, shot.finalWeight,
+              shot.lastFlowRate, shot.stopWeight,
+              (unsigned long)shot.firstDripTime,
+              (unsigned long)shot.actuationDelay,
+              shot.finalWeight - shot.stopWeight);
+
+  json.printf(",\"summary\":{\"peakFlow\":%.2f,\"meanFlow\":%.2f"
+              ",\"flowStdDev\":%.2f,\"preinfusionTime\":%lu"
+              ",\"contactTime\":%lu,\"weightAtMark\":[",
+              summary.peakFlow, summary.meanFlow, summary.flowStdDev,
+              (unsigned long)summary.preinfusionTime,
+              (unsigned long)summary.contactTime);
+  for (int i = 0; i < WEIGHT_MARK_COUNT; i++)
+    json.printf(i > 0 ? ",%.2f" : "%.2f", summary.weightAtMark[i]);
+  json.print("]}}");
+}
+
+void WebAPI::setupGzipUpdate() {
+  // gzipped firmware, inflated straight into the other ota slot as it
+  // arrives. takes an optional ?md5= of the uncompressed image
+  on(
+      "/update/gzip", HTTP_POST,
+      [this](AsyncWebServerRequest *request) {
+        if (!updateSucceeded) {
+          sendError(request, updateErrorCode,
+                    updateError ? updateError : "no firmware sent");
+          return;
+        }
+
+        ResponseBuffer &json = beginBody();
+        json.printf("{\"compressed\":%u,\"image\":%u,\"ms\":%lu}",
+                    (unsigned)gzipUpdater.getCompressedSize(),
+                    (unsigned)gzipUpdater.getImageSize(),
+                    (unsigned long)gzipUpdater.getDuration());
+        sendBody(request);
+
+        restartAt = millis() + UPDATE_RESTART_DELAY;
+      },
+      [this](AsyncWebServerRequest *request, const String &filename,
+             size_t index, uint8_t *data, size_t len, bool final) {
+        if (index == 0) {
+          updateError = nullptr;
+          updateErrorCode = 500;
+          updateSucceeded = false;
+
+          // an upload that dropped out part way never got to end()
+          gzipUpdater.abort();
+
+          if (!bManager->lockForUpdate()) {
+            updateError = "brewing";
+            updateErrorCode = 409;
+            return;
+          }
+
+          const char *md5 = nullptr;
+          if (request->hasParam("md5"))
+            md5 = request->getParam("md5")->value().c_str();
+
+          if (!gzipUpdater.begin(md5)) {
+            updateError = gzipUpdater.getError();
+            bManager->unlockForUpdate();
+            return;
+          }
+        }
+
+        if (updateError)
+          return;
+
+        if (!gzipUpdater.write(data, len) || (final && !gzipUpdater.end())) {
+          updateError = gzipUpdater.getError();
+          updateErrorCode = 400;
+          bManager->unlockForUpdate();
+          return;
+        }
+
+        // stays locked until the restart
+        if (final)
+          updateSucceeded = true;
+      });
+}
+
 void WebAPI::setupRoutes() {
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods",
                                        "GET, POST, OPTIONS");
-  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers",
-                                       "Content-Type, Authorization");
+  DefaultHeaders::Instance().addHeader(
+      "Access-Control-Allow-Headers",
+      "Content-Type, Authorization, If-None-Match");
+  DefaultHeaders::Instance().addHeader(
+      "Access-Control-Expose-Headers",
+      "ETag, X-Log-Sequence, X-Log-Dropped");
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Private-Network",
                                        "true");
 
-  server.onNotFound([](AsyncWebServerRequest *request) {
-    if (request->method() == HTTP_OPTIONS) {
-      request->send(204);
+  server.onNotFound(
+      track("ANY", "*", [](AsyncWebServerRequest *request) {
+        if (request->method() == HTTP_OPTIONS) {
+          request->send(204);
+        } else {
+          request->send(404, "application/json", "{\"error\":\"Not Found\"}");
+        }
+      }));
+
+  on("/start", HTTP_POST, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
+
+    if (!bManager->isEnabled()) {
+      sendError(request, 400,
+                "Brew control is currently disabled. Please enable in "
+                "settings");
+      return;
+    }
+
+    if (!request->hasParam("weight", true)) {
+      sendError(request, 400, "Missing target weight parameter");
+      return;
+    }
+
+    float targetWeight = request->getParam("weight", true)->value().toFloat();
+    if (targetWeight <= 0 || targetWeight > 100) {
+      sendError(request, 400, "Invalid target weight (must be between 0-100g)");
+      return;
+    }
+
+    if (!bManager->startBrew(targetWeight, true)) {
+      if (bManager->isBrewing()) {
+        sendError(request, 409, "A brew is already running");
+      } else if (!bManager->isEnabled()) {
+        sendError(request, 403, "Brewing is currently disabled");
+      } else {
+        sendError(request, 500, "Failed to start brew");
+      }
+      return;
+    }
+
+    ResponseBuffer &json = beginBody();
+    json.printf("{\"message\": \"Brew started\", \"target\": %.2f}",
+                targetWeight);
+    sendBody(request);
+  });
+
+  on("/stop", HTTP_POST, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
+
+    if (!bManager->isEnabled()) {
+      sendError(request, 400,
+                "Brew control is currently disabled. Please enable in "
+                "settings");
+      return;
+    }
+
+    bManager->abortBrew(true);
+
+    sendMessage(request, "Brew stopped");
+  });
+
+  on("/clear-data", HTTP_POST, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
+
+    if (!bManager->isEnabled()) {
+      sendError(request, 400,
+                "Brew control is currently disabled. Please enable in "
+                "settings");
+      return;
+    }
+
+    bManager->clearShotData();
+
+    sendMessage(request, "Shot data cleared");
+  });
+
+  on("/wake", HTTP_POST, [this](AsyncWebServerRequest *request) {
+    if (!bManager->isEnabled()) {
+      sendError(request, 400, "Please enable your device in bru settings");
+      return;
+    } else if (!bManager->isActive()) {
+      bManager->wake();
     } else {
-      request->send(404, "application/json", "{\"error\":\"Not Found\"}");
+      sendError(request, 400, "Already awake!");
+      return;
     }
+
+    sendMessage(request, "Waking ESP");
   });
 
-  auto handleError = [](AsyncWebServerRequest *request, int code,
-                        const char *message) {
-    request->send(code, "application/json",
-                  "{\"error\": \"" + String(message) + "\"}");
-  };
+  on("/prefs", HTTP_POST, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
 
-  server.on(
-      "/start", HTTP_POST,
-      [this, &handleError](AsyncWebServerRequest *request) {
-        if (!bManager) {
-          handleError(request, 400, "Brew manager not initialized");
-          return false;
-        }
+    // Check for ALL required parameters
+    if (!request->hasParam("isEnabled", true) ||
+        !request->hasParam("regularPreset", true) ||
+        !request->hasParam("decafPreset", true) ||
+        !request->hasParam("pMode", true) ||
+        !request->hasParam("decafStartHour", true) ||
+        !request->hasParam("timezone", true) ||
+        !request->hasParam("learningRate", true) ||
+        !request->hasParam("systemLag", true) ||
+        !request->hasParam("autoSavePreset", true) ||
+        !request->hasParam("earlyStop", true)) {
+      sendError(request, 400, "Missing required parameters");
+      return;
+    }
 
-        if (!bManager->isEnabled()) {
-          handleError(
-              request, 400,
-              "Brew control is currently disabled. Please enable in settings");
-          return false;
-        }
+    // keeps the api url and token, they're set through /token
+    BrewPrefs prefs = bManager->getPrefs();
+
+    prefs.isEnabled =
+        request->getParam("isEnabled", true)->value().equals("true");
+    prefs.regularPreset =
+        request->getParam("regularPreset", true)->value().toFloat();
+    prefs.decafPreset =
+        request->getParam("decafPreset", true)->value().toFloat();
+    prefs.pMode =
+        PreinfusionMode(request->getParam("pMode", true)->value().toInt());
+    prefs.decafStartHour =
+        request->getParam("decafStartHour", true)->value().toInt();
+    prefs.learningRate =
+        request->getParam("learningRate", true)->value().toFloat();
+    prefs.systemLag = request->getParam("systemLag", true)->value().toFloat();
+    prefs.autoSavePreset =
+        request->getParam("autoSavePreset", true)->value().equals("true");
+    prefs.earlyStop =
+        request->getParam("earlyStop", true)->value().equals("true");
+
+    const String &timezone = request->getParam("timezone", true)->value();
+    if (timezone.length() >= sizeof(prefs.timezone)) {
+      sendError(request, 400, "Timezone too long");
+      return;
+    }
+    strlcpy(prefs.timezone, timezone.c_str(), sizeof(prefs.timezone));
 
-        if (!request->hasParam("weight", true)) {
-          handleError(request, 400, "Missing target weight parameter");
-          return false;
-        }
+    if (prefs.learningRate < 0.0f || prefs.learningRate > 1.0) {
+      sendError(request, 400, "Learning Rate must be 0 - 1");
+      return;
+    }
 
-        float targetWeight =
-            request->getParam("weight", true)->value().toFloat();
-        if (targetWeight <= 0 || targetWeight > 100) {
-          handleError(request, 400,
-                      "Invalid target weight (must be between 0-100g)");
-          return false;
-        }
+    if (prefs.systemLag < 0.0f || prefs.systemLag > 2.0f) {
+      sendError(request, 400, "Lag must be 0 - 2");
+      return;
+    }
 
-        if (!bManager->startBrew(targetWeight, true)) {
-          if (bManager->isBrewing()) {
-            handleError(request, 409, "A brew is already running");
-            return false;
-          } else if (!bManager->isEnabled()) {
-            handleError(request, 403, "Brewing is currently disabled");
-            return false;
-          }
-          handleError(request, 500, "Failed to start brew");
-          return false;
-        }
+    bManager->setPrefs(prefs);
 
-        AsyncWebServerResponse *response = request->beginResponse(
-            200, "application/json",
-            "{\"message\": \"Brew started\", \"target\": " +
-                String(targetWeight) + "}");
-        request->send(response);
+    bManager->syncTimezone();
 
-        return true;
-      });
+    sendMessage(request, "Preferences updated");
+  });
 
-  server.on(
-      "/stop", HTTP_POST, [this, &handleError](AsyncWebServerRequest *request) {
-        if (!bManager) {
-          handleError(request, 400, "Brew manager not initialized");
-          return false;
-        }
+  on("/prefs", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
 
-        if (!bManager->isEnabled()) {
-          handleError(
-              request, 400,
-              "Brew control is currently disabled. Please enable in settings");
-          return false;
-        }
+    char etag[ETAG_SIZE];
+    formatETag(etag, sizeof(etag), bManager->getStateVersion());
+    if (sendNotModified(request, etag))
+      return;
+
+    const BrewPrefs &prefs = bManager->getPrefs();
+
+    ResponseBuffer &json = beginBody();
+    json.print("{\"isEnabled\":");
+    json.printBool(prefs.isEnabled);
+    json.printf(",\"regularPreset\":%.2f,\"decafPreset\":%.2f,\"pMode\":%d"
+                ",\"decafStartHour\":%d",
+                prefs.regularPreset, prefs.decafPreset, (int)prefs.pMode,
+                prefs.decafStartHour);
+    json.print(",\"timezone\":");
+    json.printString(prefs.timezone);
+    json.printf(",\"learningRate\":%.2f,\"systemLag\":%.2f",
+                prefs.learningRate, prefs.systemLag);
+    json.print(",\"autoSavePreset\":");
+    json.printBool(prefs.autoSavePreset);
+    json.print(",\"earlyStop\":");
+    json.printBool(prefs.earlyStop);
+    json.print("}");
+
+    sendBody(request, 200, "application/json", etag);
+  });
 
-        bManager->abortBrew(true);
+  // ?since= takes the version from a previous etag and only sends the shots
+  // recorded after it. clients merge them by id. if that version is from
+  // before the data was cleared, or isn't one of ours, everything is sent
+  // and "full" says so
+  on("/data", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
 
-        AsyncWebServerResponse *response = request->beginResponse(
-            200, "application/json", "{\"message\": \"Brew stopped\"}");
-        request->send(response);
+    uint32_t version = bManager->getStateVersion();
+    char etag[ETAG_SIZE];
+    formatETag(etag, sizeof(etag), version);
+    if (sendNotModified(request, etag))
+      return;
+
+    uint32_t since = 0;
+    if (request->hasParam("since"))
+      since = strtoul(request->getParam("since")->value().c_str(), nullptr, 10);
+    bool full =
+        since == 0 || since < bManager->getResetVersion() || since > version;
+
+    ResponseBuffer &json = beginBody();
+    json.printf("{\"version\":%lu,\"full\":%s,", (unsigned long)version,
+                full ? "true" : "false");
+
+    for (int p = 0; p < 2; p++) {
+      const Shot *shots = bManager->getRecentShots(p);
+      const uint32_t *versions = bManager->getShotVersions(p);
+
+      json.printf("\"p%d\":{\"bias\":%.2f,\"shots\":[", p,
+                  bManager->getFlowCompBias(p));
+      bool first = true;
+      for (int i = 0; i < MAX_HISTORY; i++) {
+        if (shots[i].id == 0 || (!full && versions[i] <= since))
+          continue;
+
+        if (!first)
+          json.print(",");
+        first = false;
+
+        printShot(json, shots[i]);
+      }
+      json.print("]},");
+    }
 
-        return true;
-      });
+    // learned delays, ms
+    json.printf("\"actuationDelay\":{\"click\":%.2f,\"preinfusion\":%.2f}",
+                bManager->getActuationDelay(STOP_CLICK) * 1000.0f,
+                bManager->getActuationDelay(STOP_FROM_PREINFUSION) * 1000.0f);
 
-  server.on(
-      "/clear-data", HTTP_POST,
-      [this, &handleError](AsyncWebServerRequest *request) {
-        if (!bManager) {
-          handleError(request, 400, "Brew manager not initialized");
-          return false;
-        }
+    json.print("}");
 
-        if (!bManager->isEnabled()) {
-          handleError(
-              request, 400,
-              "Brew control is currently disabled. Please enable in settings");
-          return false;
-        }
+    sendBody(request, 200, "application/json", etag);
+  });
 
-        bManager->clearShotData();
+  on("/accuracy", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    if (!bManager) {
+      sendError(request, 400, "Brew manager not initialized");
+      return;
+    }
 
-        AsyncWebServerResponse *response = request->beginResponse(
-            200, "application/json", "{\"message\": \"Shot data cleared\"}");
-        request->send(response);
+    ResponseBuffer &json = beginBody();
+    json.print("{");
+    for (int p = 0; p < 2; p++) {
+      const AccuracyTracker &acc = bManager->getAccuracy(p);
+
+      if (p > 0)
+        json.print(",");
+
+      json.printf("\"p%d\":{\"count\":%lu,\"mean\":%.3f,\"stdDev\":%.3f"
+                  ",\"ewma\":%.3f",
+                  p, (unsigned long)acc.getCount(), acc.getMean(),
+                  acc.getStdDev(), acc.getEwma());
+      for (int i = 0; i < AccuracyTracker::QUANTILE_COUNT; i++) {
+        json.printf(",\"p%d\":%.3f",
+                    (int)lroundf(acc.getQuantileLevel(i) * 100),
+                    acc.getQuantile(i));
+      }
+      json.print("}");
+    }
+    json.print("}");
 
-        return true;
-      });
+    sendBody(request);
+  });
 
-  server.on("/wake", HTTP_POST,
-            [this, &handleError](AsyncWebServerRequest *request) {
-              if (!bManager->isEnabled()) {
-                handleError(request, 400,
-                            "Please enable your device in bru settings");
-                return;
-              } else if (!bManager->isActive()) {
-                bManager->wake();
-              } else {
-                handleError(request, 400, "Already awake!");
-                return;
-              }
-
-              AsyncWebServerResponse *response = request->beginResponse(
-                  200, "application/json", "{\"message\": \"Waking ESP\"}");
-              request->send(response);
-
-              return;
-            });
-
-  server.on(
-      "/prefs", HTTP_POST,
-      [this, &handleError](AsyncWebServerRequest *request) {
-        if (!bManager) {
-          handleError(request, 400, "Brew manager not initialized");
-          return;
-        }
+  // state changes, buttons and relay edges for one shot, the latest unless
+  // ?shot= is given. times are us from the shot's first event
+  on("/shots/events", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    BrewEventLog &log = bManager->getEventLog();
+
+    uint16_t shot = log.getCurrentShot();
+    if (request->hasParam("shot"))
+      shot = request->getParam("shot")->value().toInt();
+
+    size_t count =
+        log.getShotEvents(shot, eventScratch, BrewEventLog::CAPACITY);
+    int64_t start = count > 0 ? eventScratch[0].timeUs : 0;
+
+    ResponseBuffer &json = beginBody();
+    json.printf("{\"shot\":%u,\"startMs\":%lu,\"events\":[", (unsigned)shot,
+                (unsigned long)(start / 1000));
+    for (size_t i = 0; i < count; i++) {
+      const BrewEvent &event = eventScratch[i];
+      json.printf("%s{\"us\":%lu,\"type\":\"%s\",\"value\":%u"
+                  ",\"cause\":\"%s\"}",
+                  i > 0 ? "," : "", (unsigned long)(event.timeUs - start),
+                  BrewEventLog::getTypeName(event.type), (unsigned)event.value,
+                  BrewEventLog::getCauseName(event.cause));
+    }
+    json.print("]}");
 
-        // Check for ALL required parameters
-        if (!request->hasParam("isEnabled", true) ||
-            !request->hasParam("regularPreset", true) ||
-            !request->hasParam("decafPreset", true) ||
-            !request->hasParam("pMode", true) ||
-            !request->hasParam("decafStartHour", true) ||
-            !request->hasParam("timezone", true) ||
-            !request->hasParam("learningRate", true) ||
-            !request->hasParam("systemLag", true) ||
-            !request->hasParam("autoSavePreset", true) ||
-            !request->hasParam("earlyStop", true)) {
-          handleError(request, 400, "Missing required parameters");
-          return;
-        }
+    sendBody(request);
+  });
 
-        BrewPrefs prefs;
-
-        prefs.isEnabled =
-            request->getParam("isEnabled", true)->value().equals("true");
-        prefs.regularPreset =
-            request->getParam("regularPreset", true)->value().toFloat();
-        prefs.decafPreset =
-            request->getParam("decafPreset", true)->value().toFloat();
-        prefs.pMode =
-            PreinfusionMode(request->getParam("pMode", true)->value().toInt());
-        prefs.decafStartHour =
-            request->getParam("decafStartHour", true)->value().toInt();
-        prefs.timezone = request->getParam("timezone", true)->value();
-        prefs.learningRate =
-            request->getParam("learningRate", true)->value().toFloat();
-        prefs.systemLag =
-            request->getParam("systemLag", true)->value().toFloat();
-        prefs.autoSavePreset =
-            request->getParam("autoSavePreset", true)->value().equals("true");
-        prefs.earlyStop =
-            request->getParam("earlyStop", true)->value().equals("true");
-
-        if (prefs.learningRate < 0.0f || prefs.learningRate > 1.0) {
-          handleError(request, 400, "Learning Rate must be 0 - 1");
-          return;
-        }
+  // formatted log history as text, one line per message. ?since= takes the
+  // last sequence number seen to only get what's new
+  on("/logs", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    uint32_t since = 0;
+    if (request->hasParam("since"))
+      since = request->getParam("since")->value().toInt();
+
+    Logger *logger = Logger::getInstance();
+    uint32_t latest = logger->getHistory(responseArena,
+                                         sizeof(responseArena), since);
+
+    char sequence[12], dropped[12];
+    snprintf(sequence, sizeof(sequence), "%lu", (unsigned long)latest);
+    snprintf(dropped, sizeof(dropped), "%lu",
+             (unsigned long)logger->getDroppedCount());
+
+    AsyncWebServerResponse *res =
+        request->beginResponse(200, "text/plain", responseArena);
+    res->addHeader("X-Log-Sequence", sequence);
+    res->addHeader("X-Log-Dropped", dropped);
+    request->send(res);
+  });
 
-        if (prefs.systemLag < 0.0f || prefs.systemLag > 2.0f) {
-          handleError(request, 400, "Lag must be 0 - 2");
-          return;
-        }
+  on("/debug/boot", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    BootProfile *boot = BootProfile::getInstance();
+
+    ResponseBuffer &json = beginBody();
+    json.printf("{\"resetReason\":\"%s\"",
+                BootProfile::getResetReasonName());
+    json.print(",\"fastConnect\":");
+    json.printBool(fastConnect);
+    json.print(",\"staticIp\":");
+    json.printBool(staticIP);
+
+    // us since the app started, null for phases that haven't happened
+    json.print(",\"phasesUs\":{");
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+      BootPhase phase = (BootPhase)i;
+      uint32_t time = boot->getPhaseTime(phase);
+      json.printf("%s\"%s\":", i > 0 ? "," : "",
+                  BootProfile::getPhaseName(phase));
+      if (time)
+        json.printf("%lu", (unsigned long)time);
+      else
+        json.print("null");
+    }
+    json.print("}");
+    json.printf(",\"uptime\":%lu}", (unsigned long)millis());
 
-        bManager->setPrefs(prefs);
+    sendBody(request);
+  });
 
-        bManager->syncTimezone();
+  // heap state now and per endpoint. minFree is the low water mark since
+  // boot, largestBlock is what a single malloc could get right now
+  on("/debug/heap", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    ResponseBuffer &json = beginBody();
+    json.printf("{\"free\":%lu,\"minFree\":%lu,\"largestBlock\":%lu"
+                ",\"allocations\":%lu,\"arena\":%u",
+                (unsigned long)ESP.getFreeHeap(),
+                (unsigned long)ESP.getMinFreeHeap(),
+                (unsigned long)ESP.getMaxAllocHeap(),
+                (unsigned long)HeapStats::getAllocationCount(),
+                (unsigned)sizeof(responseArena));
+
+    json.print(",\"endpoints\":[");
+    for (size_t i = 0; i < heapStats->getEndpointCount(); i++) {
+      const EndpointStats &stats = heapStats->getEndpoint(i);
+      json.printf("%s{\"method\":\"%s\",\"path\":\"%s\",\"requests\":%lu"
+                  ",\"allocations\":%lu,\"maxAllocations\":%lu"
+                  ",\"maxHeapHeld\":%lu",
+                  i > 0 ? "," : "", stats.method, stats.path,
+                  (unsigned long)stats.requests,
+                  (unsigned long)stats.allocations,
+                  (unsigned long)stats.maxAllocations,
+                  (unsigned long)stats.maxHeapHeld);
+      if (stats.requests)
+        json.printf(",\"minLargestBlock\":%lu}",
+                    (unsigned long)stats.minLargestBlock);
+      else
+        json.print(",\"minLargestBlock\":null}");
+    }
+    json.print("]}");
 
-        AsyncWebServerResponse *response = request->beginResponse(
-            200, "application/json", "{\"message\": \"Preferences updated\"}");
-        request->send(response);
-      });
+    sendBody(request);
+  });
 
-  server.on("/prefs", HTTP_GET,
-            [this, &handleError](AsyncWebServerRequest *request) {
-              if (!bManager) {
-                handleError(request, 400, "Brew manager not initialized");
-                return;
-              }
-
-              BrewPrefs prefs = bManager->getPrefs();
-
-              String response = "{";
-              response +=
-                  "\"isEnabled\":" + String(prefs.isEnabled ? "true" : "false");
-              response += ",\"regularPreset\":" + String(prefs.regularPreset);
-              response += ",\"decafPreset\":" + String(prefs.decafPreset);
-              response += ",\"pMode\":" + String(prefs.pMode);
-              response += ",\"decafStartHour\":" + String(prefs.decafStartHour);
-              response += ",\"timezone\":\"" + prefs.timezone + "\"";
-              response += ",\"learningRate\":" + String(prefs.learningRate);
-              response += ",\"systemLag\":" + String(prefs.systemLag);
-              response +=
-                  ",\"autoSavePreset\":" + String(prefs.autoSavePreset ? "true" : "false");
-              response +=
-                  ",\"earlyStop\":" + String(prefs.earlyStop ? "true" : "false");
-              response += "}";
-
-              AsyncWebServerResponse *resp =
-                  request->beginResponse(200, "application/json", response);
-              request->send(resp);
-            });
-
-  server.on(
-      "/data", HTTP_GET, [this, &handleError](AsyncWebServerRequest *request) {
-        if (!bManager) {
-          handleError(request, 400, "Brew manager not initialized");
-          return;
-        }
+  on("/power", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    ResponseBuffer &json = beginBody();
+    json.print("{\"configured\":");
+    json.printBool(pManager->isConfigured());
+    json.print(",\"lightSleep\":");
+    json.printBool(pManager->isLightSleepEnabled());
+    json.print(",\"boosted\":");
+    json.printBool(pManager->isBoosted());
+    json.printf(",\"radioMode\":\"%s\"",
+                PowerManager::getRadioModeName(pManager->getRadioMode()));
+    json.printf(",\"cpuFreq\":%lu,\"boostCount\":%lu"
+                ",\"lastBoostLatencyUs\":%lu,\"maxBoostLatencyUs\":%lu"
+                ",\"boostedTime\":%lu",
+                (unsigned long)getCpuFrequencyMhz(),
+                (unsigned long)pManager->getBoostCount(),
+                (unsigned long)pManager->getLastBoostLatency(),
+                (unsigned long)pManager->getMaxBoostLatency(),
+                (unsigned long)pManager->getBoostedTime());
+
+    // what's been waking the main loop
+    Scheduler *scheduler = Scheduler::getInstance();
+    json.print(",\"wakeups\":{");
+    for (int i = 0; i < WAKE_CAUSE_COUNT; i++) {
+      WakeCause cause = (WakeCause)i;
+      json.printf("%s\"%s\":%lu", i > 0 ? "," : "",
+                  Scheduler::getWakeCauseName(cause),
+                  (unsigned long)scheduler->getWakeCount(cause));
+    }
+    json.print("}");
 
-        const Shot *shots0 = bManager->getRecentShots(0);
-        const Shot *shots1 = bManager->getRecentShots(1);
+    json.printf(",\"uptime\":%lu}", (unsigned long)millis());
 
-        float factor0 = bManager->getFlowCompBias(0);
-        float factor1 = bManager->getFlowCompBias(1);
+    sendBody(request);
+  });
 
-        String response = "{";
+  on("/scale", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    ResponseBuffer &json = beginBody();
+    json.print("{\"connected\":");
+    json.printBool(sManager->isConnected());
+    json.print(",\"address\":");
+    json.printString(sManager->getScaleAddress().c_str());
+    json.printf(",\"driver\":\"%s\"", sManager->getDriverName());
+    json.print(",\"cachedAddress\":");
+    json.printBool(sManager->hasCachedAddress());
+    json.print(",\"directConnect\":");
+    json.printBool(sManager->wasDirectConnect());
+    json.printf(",\"connectLatency\":%lu,\"packetInterval\":%lu"
+                ",\"packetRate\":%.2f",
+                (unsigned long)sManager->getConnectLatency(),
+                (unsigned long)sManager->getPacketInterval(),
+                sManager->getPacketRate());
+    json.print(",\"lowLatency\":");
+    json.printBool(sManager->isLowLatency());
+    json.printf(",\"connInterval\":%.2f,\"connLatency\":%u"
+                ",\"supervisionTimeout\":%u",
+                sManager->getConnInterval() * 1.25f,
+                (unsigned)sManager->getConnLatency(),
+                (unsigned)sManager->getSupervisionTimeout() * 10);
+
+    // packet inter-arrival per radio mode
+    json.print(",\"jitter\":{");
+    for (int i = 0; i < RADIO_MODE_COUNT; i++) {
+      RadioMode mode = (RadioMode)i;
+      JitterStats jitter = sManager->getJitterStats(mode);
+
+      json.printf("%s\"%s\":{\"count\":%lu,\"meanMs\":%.2f"
+                  ",\"stdDevMs\":%.2f,\"maxMs\":%lu}",
+                  i > 0 ? "," : "", PowerManager::getRadioModeName(mode),
+                  (unsigned long)jitter.count, jitter.meanMs, jitter.stdDevMs,
+                  (unsigned long)jitter.maxMs);
+    }
+    json.print("}");
+
+    json.printf(
+        ",\"packets\":%lu,\"spikes\":%lu",
+        (unsigned long)sManager->getPacketCount(),
+        (unsigned long)sManager->getSpikeCount());
+    json.printf(
+        ",\"rejected\":{\"tooShort\":%lu,\"badHeader\":%lu"
+        ",\"badChecksum\":%lu,\"badFormat\":%lu}",
+        (unsigned long)sManager->getRejectedCount(DECODE_TOO_SHORT),
+        (unsigned long)sManager->getRejectedCount(DECODE_BAD_HEADER),
+        (unsigned long)sManager->getRejectedCount(DECODE_BAD_CHECKSUM),
+        (unsigned long)sManager->getRejectedCount(DECODE_BAD_FORMAT));
+
+    json.print(",\"commands\":{");
+    for (int i = 0; i < CMD_COUNT; i++) {
+      ScaleCommand cmd = (ScaleCommand)i;
+      CommandStats stats = sManager->getCommandStats(cmd);
+
+      json.printf("%s\"%s\":{\"sent\":%lu,\"failed\":%lu,\"coalesced\":%lu"
+                  ",\"dropped\":%lu,\"avgLatencyUs\":%lu"
+                  ",\"maxLatencyUs\":%lu}",
+                  i > 0 ? "," : "", ScaleManager::getCommandName(cmd),
+                  (unsigned long)stats.sent, (unsigned long)stats.failed,
+                  (unsigned long)stats.coalesced, (unsigned long)stats.dropped,
+                  (unsigned long)(stats.sent ? stats.totalLatencyUs / stats.sent
+                                             : 0),
+                  (unsigned long)stats.maxLatencyUs);
+    }
+    json.print("}}");
 
-        response += "\"p0\":{\"bias\":" + String(factor0) + ",\"shots\":[";
-        for (int i = 0; i < MAX_HISTORY; i++) {
-          if (shots0[i].id == 0)
-            continue;
+    sendBody(request);
+  });
 
-          if (i > 0 && shots0[i - 1].id != 0)
-            response += ",";
+  on("/token", HTTP_POST, [this](AsyncWebServerRequest *request) {
+    if (!request->hasParam("apiUrl", true) ||
+        !request->hasParam("apiToken", true)) {
+      sendError(request, 400, "Missing required parameters");
+      return;
+    }
 
-          response += "{\"id\":" + String(shots0[i].id) +
-                      ",\"targetWeight\":" + String(shots0[i].targetWeight) +
-                      ",\"finalWeight\":" + String(shots0[i].finalWeight) +
-                      ",\"lastFlowRate\":" + String(shots0[i].lastFlowRate) +
-                      ",\"stopWeight\":" + String(shots0[i].stopWeight) +
-                      ",\"drippage\":" +
-                      String(shots0[i].finalWeight - shots0[i].stopWeight) +
-                      "}";
-        }
-        response += "]},";
-
-        response += "\"p1\":{\"bias\":" + String(factor1) + ",\"shots\":[";
-        for (int i = 0; i < MAX_HISTORY; i++) {
-          if (shots1[i].id == 0)
-            continue;
-
-          if (i > 0 && shots1[i - 1].id != 0)
-            response += ",";
-
-          response += "{\"id\":" + String(shots1[i].id) +
-                      ",\"targetWeight\":" + String(shots1[i].targetWeight) +
-                      ",\"finalWeight\":" + String(shots1[i].finalWeight) +
-                      ",\"lastFlowRate\":" + String(shots1[i].lastFlowRate) +
-                      ",\"stopWeight\":" + String(shots1[i].stopWeight) +
-                      ",\"drippage\":" +
-                      String(shots1[i].finalWeight - shots1[i].stopWeight) +
-                      "}";
-        }
-        response += "]}";
+    const String &apiUrl = request->getParam("apiUrl", true)->value();
+    const String &apiToken = request->getParam("apiToken", true)->value();
 
-        response += "}";
+    BrewPrefs prefs = bManager->getPrefs();
+    if (apiUrl.length() >= sizeof(prefs.apiUrl) ||
+        apiToken.length() >= sizeof(prefs.apiToken)) {
+      sendError(request, 400, "API url or token too long");
+      return;
+    }
+    strlcpy(prefs.apiUrl, apiUrl.c_str(), sizeof(prefs.apiUrl));
+    strlcpy(prefs.apiToken, apiToken.c_str(), sizeof(prefs.apiToken));
 
-        AsyncWebServerResponse *resp =
-            request->beginResponse(200, "application/json", response);
-        request->send(resp);
-      });
+    bManager->setPrefs(prefs);
 
-  server.on("/token", HTTP_POST,
-            [this, &handleError](AsyncWebServerRequest *request) {
-              if (!request->hasParam("apiUrl", true) ||
-                  !request->hasParam("apiToken", true)) {
-                handleError(request, 400, "Missing required parameters");
-                return;
-              }
-
-              BrewPrefs prefs = bManager->getPrefs();
-              prefs.apiUrl = request->getParam("apiUrl", true)->value();
-              prefs.apiToken = request->getParam("apiToken", true)->value();
-
-              bManager->setPrefs(prefs);
-
-              AsyncWebServerResponse *response = request->beginResponse(
-                  200, "application/json",
-                  "{\"message\": \"Token configured successfully\"}");
-              request->send(response);
-            });
+    sendMessage(request, "Token configured successfully");
+  });
 }
 
 void WebAPI::begin() {
   sManager = ScaleManager::getInstance();
   bManager = BrewManager::getInstance();
+  pManager = PowerManager::getInstance();
+  heapStats = HeapStats::getInstance();
 
   DEBUG_PRINTF("Entering wifi setup\n");
   setupWiFi();
   setupWebSocket();
   setupRoutes();
+  // before the update server, its /update handler also matches /update/gzip
+  setupGzipUpdate();
   updateServer.setup(&server);
-  updateServer.onUpdateBegin = [](const UpdateType type, int &result) {};
+  updateServer.onUpdateBegin = [this](const UpdateType type, int &result) {
+    if (!bManager->lockForUpdate())
+      result = UPDATE_ABORT;
+  };
+  updateServer.onUpdateEnd = [this](const UpdateType type, int &result) {
+    if (result != UPDATE_OK)
+      bManager->unlockForUpdate();
+  };
   server.begin();
 }
 
 void WebAPI::update() {
+  if (restartAt) {
+    if ((long)(millis() - restartAt) >= 0)
+      ESP.restart();
+    Scheduler::getInstance()->wakeAt(restartAt);
+  }
+
+  if (fastConnectFailed) {
+    // AP moved channel or went away, forget it and do a full scan
+    fastConnectFailed = false;
+    INFO_PRINTF("Fast WiFi connect failed, scanning...\n");
+    clearWiFiCache();
+    WiFi.disconnect();
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    lastWiFiCheck = millis();
+  }
+
   if (millis() - lastWiFiCheck >= WIFI_CHECK_INTERVAL) {
     checkWiFiConnection();
     lastWiFiCheck = millis();
@@ -403,24 +909,20 @@ void WebAPI::update() {
     broadcastBrewMetrics();
     lastWebSocketUpdate = millis();
   }
+
+  Scheduler *scheduler = Scheduler::getInstance();
+  scheduler->wakeAt(lastWiFiCheck + WIFI_CHECK_INTERVAL);
+  // nobody listening, nothing to push
+  if (ws.count())
+    scheduler->wakeAt(lastWebSocketUpdate + currentInterval);
 }
 
 void WebAPI::checkWiFiConnection() {
   if (WiFi.status() != WL_CONNECTED) {
-    DEBUG_PRINTF("WiFi disconnected, attempting reconnection...\n");
+    WARN_PRINTF("WiFi disconnected, attempting reconnection...\n");
     WiFi.disconnect();
+    // the got IP event picks it up from here
     WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-
-    // Wait up to 10 seconds for connection
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 10) {
-      delay(1000);
-      attempts++;
-    }
-
-    if (WiFi.status() == WL_CONNECTED) {
-      DEBUG_PRINTF("Reconnected to WiFi, IP: %s\n", WiFi.localIP().toString());
-    }
   }
 }
 
@@ -438,7 +940,9 @@ void WebAPI::broadcastBrewMetrics() {
                          .time = scaleReady ? sManager->getTime() : 0,
                          .state = (uint8_t)bManager->getState(),
                          .isActive = bManager->isActive(),
-                         .isScaleConnected = scaleReady};
+                         .isScaleConnected = scaleReady,
+                         .flowWindow =
+                             scaleReady ? sManager->getFlowWindow() : (uint8_t)0};
 
   for (AsyncWebSocketClient &c : ws.getClients()) {
     if (c.canSend() && c.queueLen() < 5) {
@@ -1,7 +1,13 @@
 #include "BrewManager.h"
+#include "GzipUpdater.h"
+#include "HeapStats.h"
+#include "PowerManager.h"
+#include "ResponseBuffer.h"
 #include "ScaleManager.h"
+#include "Scheduler.h"
 #include <ESPAsyncHTTPUpdateServer.h>
 #include <ESPAsyncWebServer.h>
+#include <atomic>
 
 struct BrewMetrics {
   float weight;
@@ -11,6 +17,7 @@ struct BrewMetrics {
   uint8_t state;
   bool isActive;         // tells frontend whether we're actively scanning
   bool isScaleConnected; // tells fe whether we're connected
+  uint8_t flowWindow;     // samples the flow estimate was fitted over
 } __attribute__((packed));
 
 class WebAPI {
@@ -24,23 +31,81 @@ private:
   AsyncWebServer server;
   AsyncWebSocket ws;
   ESPAsyncHTTPUpdateServer updateServer;
+  GzipUpdater gzipUpdater;
 
   ScaleManager *sManager;
   BrewManager *bManager;
+  PowerManager *pManager;
+  HeapStats *heapStats;
+
+  // every handler runs on the async_tcp task, one at a time, and send()
+  // copies the body out, so one arena allocated at boot covers them all.
+  // big enough for /data with both histories full
+  static constexpr size_t RESPONSE_ARENA_SIZE = 20 * 1024;
+  // quoted uint32
+  static constexpr size_t ETAG_SIZE = 16;
+  char responseArena[RESPONSE_ARENA_SIZE];
+  ResponseBuffer body{responseArena, sizeof(responseArena)};
+  // for /shots/events, same reason
+  BrewEvent eventScratch[BrewEventLog::CAPACITY];
 
   ulong lastWebSocketUpdate = 0;
   ulong lastWiFiCheck = 0;
 
+  // gzip ota upload state, the result is sent once the upload's done
+  const char *updateError = nullptr;
+  int updateErrorCode = 500;
+  bool updateSucceeded = false;
+  ulong restartAt = 0;
+  // let the response get out before rebooting
+  static constexpr ulong UPDATE_RESTART_DELAY = 1000;
+
+  // connected straight to the cached AP instead of scanning
+  bool fastConnect = false;
+  bool staticIP = false;
+  // set from the wifi event task
+  std::atomic<bool> fastConnectPending{false};
+  std::atomic<bool> fastConnectFailed{false};
+
   static constexpr ushort MAX_WS_CLIENTS = 8;
   static constexpr ulong WIFI_CHECK_INTERVAL = 10 * 1000;
 
   void checkWiFiConnection();
+  void onWiFiConnected();
+
+  // last AP we connected to, so the next boot can skip the scan
+  bool loadWiFiCache(uint8_t *bssid, uint8_t &channel);
+  void saveWiFiCache(const uint8_t *bssid, int32_t channel);
+  void clearWiFiCache();
 
   void broadcastBrewMetrics();
 
   void setupWiFi();
   void setupRoutes();
   void setupWebSocket();
+  void setupGzipUpdate();
+
+  // server.on() with the handler's heap use recorded in heapStats
+  void on(const char *path, WebRequestMethodComposite method,
+          ArRequestHandlerFunction handler,
+          ArUploadHandlerFunction upload = nullptr);
+  ArRequestHandlerFunction track(const char *method, const char *path,
+                                 ArRequestHandlerFunction handler);
+
+  // the shared arena, emptied
+  ResponseBuffer &beginBody();
+  // with an etag the client is told to check back with it before reusing
+  // its copy
+  void sendBody(AsyncWebServerRequest *request, int code = 200,
+                const char *type = "application/json",
+                const char *etag = nullptr);
+  // true if the client's If-None-Match already has this etag, it's been
+  // sent a 304 and there's nothing else to do
+  static bool sendNotModified(AsyncWebServerRequest *request,
+                              const char *etag);
+  static void sendError(AsyncWebServerRequest *request, int code,
+                        const char *message);
+  static void sendMessage(AsyncWebServerRequest *request, const char *message);
 
 public:
   void begin();
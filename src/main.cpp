@@ -1,9 +1,17 @@
+#include "BootProfile.h"
 #include "BrewManager.h"
+#include "Logger.h"
+#include "PowerManager.h"
 #include "ScaleManager.h"
+#include "Scheduler.h"
 #include "WebApi.h"
 #include "debug.h"
 #include <Adafruit_NeoPixel.h>
 
+static BootProfile *boot;
+static Logger *logger;
+static Scheduler *scheduler;
+static PowerManager *pManager;
 static ScaleManager *sManager;
 static BrewManager *bManager;
 static WebAPI *webApi;
@@ -12,11 +20,17 @@ static WebAPI *webApi;
 #define NUM_LEDS 1
 #define BRIGHTNESS 10
 
+// between batches while the log ring has a backlog
+#define LOG_DRAIN_INTERVAL 10
+
 Adafruit_NeoPixel pixels(NUM_LEDS, LED_PIN, NEO_GRB + NEO_KHZ800);
 
 void setup() {
+  boot = BootProfile::getInstance();
+  boot->mark(BOOT_SETUP);
+  logger = Logger::getInstance();
+
   Serial.begin(115200);
-  delay(2000);
 
   pixels.begin();
   pixels.setBrightness(BRIGHTNESS);
@@ -26,27 +40,43 @@ void setup() {
 
   DEBUG_PRINTF("SETUP...\n");
 
+  scheduler = Scheduler::getInstance();
+  pManager = PowerManager::getInstance();
   sManager = ScaleManager::getInstance();
   bManager = BrewManager::getInstance();
   webApi = WebAPI::getInstance();
 
-  sManager->begin();
-  DEBUG_PRINTF("Started ScaleManager\n");
+  // before anything that notifies it
+  scheduler->begin();
+  pManager->begin();
+  DEBUG_PRINTF("Started PowerManager\n");
+  // buttons and relay first so the machine can be used straight away, the
+  // scale and wifi connect in the background after this
   bManager->begin();
+  boot->mark(BOOT_BREW_READY);
   DEBUG_PRINTF("Started BrewManager\n");
+  sManager->begin();
+  boot->mark(BOOT_BLE_READY);
+  DEBUG_PRINTF("Started ScaleManager\n");
   webApi->begin();
+  boot->mark(BOOT_WEB_READY);
   DEBUG_PRINTF("Started WebAPI\n");
 }
 
 void loop() {
+  // sleeps until a button, the scale, a web request or the next deadline
+  // asked for by the updates below
+  scheduler->wait();
+
   webApi->update();
 
   if (bManager->isEnabled())
     bManager->update();
 
-  if (bManager->isActive()) {
+  if (bManager->isActive())
     sManager->update();
-  } else {
-    delay(100);
-  }
+
+  // formatting waits until there's no shot to get in the way of
+  if (!bManager->isBrewing() && logger->drain())
+    scheduler->wakeIn(LOG_DRAIN_INTERVAL);
 }
@@ -0,0 +1,83 @@
+#include "ScaleDrivers.h"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+/**
+ * Decode throughput on the host. Runs in its own env without the
+ * sanitizers, `pio test -e native_bench`. The numbers are only good for
+ * comparing one change against another on the same machine, not for what
+ * the esp32 manages.
+ */
+
+static constexpr size_t PACKET_COUNT = 256;
+static constexpr uint32_t ROUNDS = 4000;
+
+void setUp() {}
+void tearDown() {}
+
+template <typename Driver>
+static void bench(uint8_t (*packets)[Driver::WEIGHT_PACKET_LEN]) {
+  uint32_t ok = 0;
+  float sum = 0.0f;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < ROUNDS; round++) {
+    for (size_t i = 0; i < PACKET_COUNT; i++) {
+      WeightSample sample;
+      if (Driver::decode(packets[i], Driver::WEIGHT_PACKET_LEN, sample) ==
+          DECODE_OK) {
+        ok++;
+        sum += sample.weightGrams;
+      }
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  uint32_t decoded = ROUNDS * PACKET_COUNT;
+  TEST_ASSERT_EQUAL_UINT32(decoded, ok);
+
+  double ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  char message[128];
+  // the sum keeps the compiler from dropping the loop
+  snprintf(message, sizeof(message),
+           "%s: %.1f ns/packet, %.1f M packets/s (checksum %.0f)",
+           Driver::NAME, ns / decoded, decoded / ns * 1000.0, (double)sum);
+  TEST_MESSAGE(message);
+}
+
+void test_bench_bookoo() {
+  static uint8_t packets[PACKET_COUNT][BookooDriver::WEIGHT_PACKET_LEN];
+  for (size_t i = 0; i < PACKET_COUNT; i++) {
+    uint8_t *packet = packets[i];
+    memset(packet, 0, BookooDriver::WEIGHT_PACKET_LEN);
+    packet[0] = 0x03;
+    packet[1] = 0x0B;
+    packet[6] = (i & 1) ? '+' : '-';
+    packet[8] = i >> 4;
+    packet[9] = i * 7;
+    packet[19] = xorChecksum(packet, 19);
+  }
+  bench<BookooDriver>(packets);
+}
+
+void test_bench_felicita() {
+  static uint8_t packets[PACKET_COUNT][FelicitaDriver::WEIGHT_PACKET_LEN];
+  for (size_t i = 0; i < PACKET_COUNT; i++) {
+    char text[FelicitaDriver::WEIGHT_PACKET_LEN + 1];
+    snprintf(text, sizeof(text), "\x01\x02%c%06u g    d\r\n",
+             (i & 1) ? '+' : '-', (unsigned)(i * 137));
+    memcpy(packets[i], text, FelicitaDriver::WEIGHT_PACKET_LEN);
+  }
+  bench<FelicitaDriver>(packets);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_bench_bookoo);
+  RUN_TEST(test_bench_felicita);
+  return UNITY_END();
+}
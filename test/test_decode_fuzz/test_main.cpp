@@ -0,0 +1,137 @@
+#include "ScaleDrivers.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+/**
+ * Random bytes through every decoder. Built with ASan and UBSan in the
+ * native env, so a read past the packet or an overflow in the parsing fails
+ * the run even if the result looks fine. Each input gets its own exact-size
+ * allocation so ASan sees the real end of the packet.
+ */
+
+static constexpr uint32_t ITERATIONS = 200000;
+static constexpr size_t MAX_LENGTH = 64;
+
+static uint32_t rngState = 0x2545F491;
+
+static uint32_t nextRandom() {
+  // xorshift32, fixed seed so a failure reproduces
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// a valid packet for the driver, so the mutations get past the header
+static size_t makeSeed(ScaleDriverType type, uint8_t *packet) {
+  if (type == DRIVER_BOOKOO) {
+    memset(packet, 0, BookooDriver::WEIGHT_PACKET_LEN);
+    packet[0] = 0x03;
+    packet[1] = 0x0B;
+    packet[6] = '+';
+    packet[8] = 0x30;
+    packet[9] = 0x39;
+    packet[19] = xorChecksum(packet, 19);
+    return BookooDriver::WEIGHT_PACKET_LEN;
+  }
+
+  memcpy(packet, "\x01\x02+012345 g    d\r\n", FelicitaDriver::WEIGHT_PACKET_LEN);
+  return FelicitaDriver::WEIGHT_PACKET_LEN;
+}
+
+static size_t makeInput(ScaleDriverType type, uint8_t *buffer) {
+  size_t length;
+
+  switch (nextRandom() % 3) {
+  case 0:
+    // pure noise
+    length = nextRandom() % (MAX_LENGTH + 1);
+    for (size_t i = 0; i < length; i++)
+      buffer[i] = nextRandom();
+    break;
+  case 1: {
+    // a good packet with a few bytes flipped
+    length = makeSeed(type, buffer);
+    int flips = 1 + nextRandom() % 3;
+    for (int i = 0; i < flips; i++)
+      buffer[nextRandom() % length] ^= 1 << (nextRandom() % 8);
+    break;
+  }
+  default:
+    // a good packet cut short or with junk after it
+    length = makeSeed(type, buffer);
+    if (nextRandom() & 1) {
+      length = nextRandom() % length;
+    } else {
+      size_t extra = nextRandom() % (MAX_LENGTH - length + 1);
+      for (size_t i = 0; i < extra; i++)
+        buffer[length + i] = nextRandom();
+      length += extra;
+    }
+    break;
+  }
+
+  return length;
+}
+
+template <typename Driver> static void fuzz(float maxWeight) {
+  uint32_t counts[DECODE_STATUS_COUNT] = {};
+  uint8_t buffer[MAX_LENGTH];
+
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    size_t length = makeInput(Driver::TYPE, buffer);
+
+    uint8_t *packet = new uint8_t[length];
+    memcpy(packet, buffer, length);
+
+    WeightSample sample = {};
+    DecodeStatus status = Driver::decode(packet, length, sample);
+    delete[] packet;
+
+    TEST_ASSERT_TRUE(status < DECODE_STATUS_COUNT);
+    counts[status]++;
+
+    if (status == DECODE_OK) {
+      TEST_ASSERT_TRUE(length >= Driver::WEIGHT_PACKET_LEN);
+      TEST_ASSERT_TRUE(isfinite(sample.weightGrams));
+      TEST_ASSERT_TRUE(fabsf(sample.weightGrams) <= maxWeight);
+    }
+  }
+
+  // the mutations have to reach the payload for this to mean anything
+  TEST_ASSERT_TRUE(counts[DECODE_OK] > 0);
+  TEST_ASSERT_TRUE(counts[DECODE_TOO_SHORT] > 0);
+  TEST_ASSERT_TRUE(counts[DECODE_BAD_HEADER] > 0);
+
+  char message[128];
+  snprintf(message, sizeof(message),
+           "%s: ok %u, short %u, header %u, checksum %u, format %u",
+           Driver::NAME, (unsigned)counts[DECODE_OK],
+           (unsigned)counts[DECODE_TOO_SHORT],
+           (unsigned)counts[DECODE_BAD_HEADER],
+           (unsigned)counts[DECODE_BAD_CHECKSUM],
+           (unsigned)counts[DECODE_BAD_FORMAT]);
+  TEST_MESSAGE(message);
+}
+
+void test_fuzz_bookoo() {
+  // 24 bit weight in 0.01g
+  fuzz<BookooDriver>(167772.15f);
+}
+
+void test_fuzz_felicita() {
+  // six digits in 0.01g
+  fuzz<FelicitaDriver>(9999.99f);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_fuzz_bookoo);
+  RUN_TEST(test_fuzz_felicita);
+  return UNITY_END();
+}
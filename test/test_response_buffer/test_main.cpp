@@ -0,0 +1,182 @@
+#include "ResponseBuffer.h"
+#include <string.h>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+void test_print_and_printf() {
+  char data[64];
+  ResponseBuffer body(data, sizeof(data));
+
+  TEST_ASSERT_EQUAL_STRING("", body.c_str());
+
+  body.print("{\"count\":");
+  body.printf("%d,\"mean\":%.2f", 3, 1.5f);
+  body.print(",\"ok\":");
+  body.printBool(true);
+  body.print("}");
+
+  TEST_ASSERT_EQUAL_STRING("{\"count\":3,\"mean\":1.50,\"ok\":true}",
+                           body.c_str());
+  TEST_ASSERT_EQUAL_size_t(strlen(body.c_str()), body.length());
+  TEST_ASSERT_FALSE(body.isOverflowed());
+}
+
+void test_exact_fit() {
+  // capacity includes the terminator
+  char data[6];
+  ResponseBuffer body(data, sizeof(data));
+
+  body.print("abcde");
+  TEST_ASSERT_FALSE(body.isOverflowed());
+  TEST_ASSERT_EQUAL_STRING("abcde", body.c_str());
+
+  body.print("f");
+  TEST_ASSERT_TRUE(body.isOverflowed());
+  TEST_ASSERT_EQUAL_STRING("abcde", body.c_str());
+}
+
+void test_print_overflow_keeps_prefix() {
+  char data[8];
+  ResponseBuffer body(data, sizeof(data));
+
+  body.print("abc");
+  body.print("defghij");
+  TEST_ASSERT_TRUE(body.isOverflowed());
+  TEST_ASSERT_EQUAL_STRING("abc", body.c_str());
+  TEST_ASSERT_EQUAL_size_t(3, body.length());
+
+  // nothing sneaks in after an overflow, even if it would fit
+  body.print("d");
+  body.printf("%d", 1);
+  body.printBool(false);
+  TEST_ASSERT_EQUAL_STRING("abc", body.c_str());
+}
+
+void test_printf_overflow_drops_partial() {
+  char data[8];
+  ResponseBuffer body(data, sizeof(data));
+
+  body.print("ab");
+  // vsnprintf would leave "cdefg" behind, it has to go
+  body.printf("%s", "cdefghijk");
+  TEST_ASSERT_TRUE(body.isOverflowed());
+  TEST_ASSERT_EQUAL_STRING("ab", body.c_str());
+  TEST_ASSERT_EQUAL_size_t(2, body.length());
+}
+
+void test_overflow_never_writes_past_the_end() {
+  char data[16];
+  memset(data, 'x', sizeof(data));
+  ResponseBuffer body(data, 8);
+
+  body.printf("%s", "0123456789");
+  body.printString("0123456789");
+  body.print("0123456789");
+
+  TEST_ASSERT_TRUE(body.isOverflowed());
+  for (size_t i = 8; i < sizeof(data); i++)
+    TEST_ASSERT_EQUAL_UINT8('x', data[i]);
+}
+
+void test_reset() {
+  char data[4];
+  ResponseBuffer body(data, sizeof(data));
+
+  body.print("abcdef");
+  TEST_ASSERT_TRUE(body.isOverflowed());
+
+  body.reset();
+  TEST_ASSERT_FALSE(body.isOverflowed());
+  TEST_ASSERT_EQUAL_size_t(0, body.length());
+  body.print("ab");
+  TEST_ASSERT_EQUAL_STRING("ab", body.c_str());
+}
+
+void test_string_escaping() {
+  char data[64];
+  ResponseBuffer body(data, sizeof(data));
+
+  body.printString("plain");
+  TEST_ASSERT_EQUAL_STRING("\"plain\"", body.c_str());
+
+  body.reset();
+  body.printString("a\"b\\c");
+  TEST_ASSERT_EQUAL_STRING("\"a\\\"b\\\\c\"", body.c_str());
+
+  body.reset();
+  body.printString("tab\there\nline\x01");
+  TEST_ASSERT_EQUAL_STRING("\"tab\\u0009here\\u000aline\\u0001\"",
+                           body.c_str());
+
+  // utf-8 goes through untouched
+  body.reset();
+  body.printString("caf\xc3\xa9");
+  TEST_ASSERT_EQUAL_STRING("\"caf\xc3\xa9\"", body.c_str());
+
+  body.reset();
+  body.printString("");
+  TEST_ASSERT_EQUAL_STRING("\"\"", body.c_str());
+}
+
+void test_escaping_overflow() {
+  // the escapes take more room than the input, they count against capacity
+  char data[8];
+  ResponseBuffer body(data, sizeof(data));
+
+  body.printString("\"\"\"\"");
+  TEST_ASSERT_TRUE(body.isOverflowed());
+  TEST_ASSERT_TRUE(body.length() < sizeof(data));
+}
+
+// what sendError and sendMessage put on the wire
+void test_error_body() {
+  char data[ResponseBuffer::SMALL_BODY_SIZE];
+  ResponseBuffer error(data, sizeof(data));
+
+  error.printObject("error", "Missing target weight parameter");
+  TEST_ASSERT_FALSE(error.isOverflowed());
+  TEST_ASSERT_EQUAL_STRING(
+      "{\"error\": \"Missing target weight parameter\"}", error.c_str());
+
+  error.reset();
+  error.printObject("error", "bad \"quote\"");
+  TEST_ASSERT_EQUAL_STRING("{\"error\": \"bad \\\"quote\\\"\"}",
+                           error.c_str());
+}
+
+void test_message_body() {
+  char data[ResponseBuffer::SMALL_BODY_SIZE];
+  ResponseBuffer response(data, sizeof(data));
+
+  response.printObject("message", "Brew stopped");
+  TEST_ASSERT_EQUAL_STRING("{\"message\": \"Brew stopped\"}",
+                           response.c_str());
+}
+
+void test_small_body_fits_longest_message() {
+  // the longest message any handler sends
+  char data[ResponseBuffer::SMALL_BODY_SIZE];
+  ResponseBuffer error(data, sizeof(data));
+
+  error.printObject(
+      "error", "Brew control is currently disabled. Please enable in settings");
+  TEST_ASSERT_FALSE(error.isOverflowed());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_print_and_printf);
+  RUN_TEST(test_exact_fit);
+  RUN_TEST(test_print_overflow_keeps_prefix);
+  RUN_TEST(test_printf_overflow_drops_partial);
+  RUN_TEST(test_overflow_never_writes_past_the_end);
+  RUN_TEST(test_reset);
+  RUN_TEST(test_string_escaping);
+  RUN_TEST(test_escaping_overflow);
+  RUN_TEST(test_error_body);
+  RUN_TEST(test_message_body);
+  RUN_TEST(test_small_body_fits_longest_message);
+  return UNITY_END();
+}
@@ -0,0 +1,193 @@
+#include "ScaleDrivers.h"
+#include <string.h>
+#include <unity.h>
+
+void setUp() {}
+void tearDown() {}
+
+// 123.45g, scale timer 0x010203 ms
+static void makeBookooPacket(uint8_t *packet, char sign = '+') {
+  const uint8_t bytes[BookooDriver::WEIGHT_PACKET_LEN] = {
+      0x03, 0x0B, 0x01, 0x02, 0x03, 0x00, (uint8_t)sign, 0x00, 0x30, 0x39,
+      '+',  0x00, 0x64, 0x50, 0x00, 0x0A, 0x01,          0x02, 0x00, 0x00};
+  memcpy(packet, bytes, sizeof(bytes));
+  packet[19] = xorChecksum(packet, 19);
+}
+
+static void makeFelicitaPacket(uint8_t *packet, char sign = '+') {
+  const char text[] = "\x01\x02+012345 g    d\r\n";
+  memcpy(packet, text, FelicitaDriver::WEIGHT_PACKET_LEN);
+  packet[2] = sign;
+}
+
+static void assertFrame(const CommandFrame &frame, const uint8_t *expected,
+                        uint8_t length) {
+  TEST_ASSERT_EQUAL_UINT8(length, frame.length);
+  if (length > 0)
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, frame.bytes, length);
+}
+
+void test_bookoo_good_packet() {
+  uint8_t packet[BookooDriver::WEIGHT_PACKET_LEN];
+  makeBookooPacket(packet);
+
+  WeightSample sample = {};
+  TEST_ASSERT_EQUAL(DECODE_OK,
+                    BookooDriver::decode(packet, sizeof(packet), sample));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 123.45f, sample.weightGrams);
+  TEST_ASSERT_EQUAL_UINT32(0x010203, sample.scaleMs);
+
+  makeBookooPacket(packet, '-');
+  TEST_ASSERT_EQUAL(DECODE_OK,
+                    BookooDriver::decode(packet, sizeof(packet), sample));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, -123.45f, sample.weightGrams);
+}
+
+void test_bookoo_longer_packet() {
+  // trailing bytes past the packet are ignored
+  uint8_t packet[BookooDriver::WEIGHT_PACKET_LEN + 4] = {};
+  makeBookooPacket(packet);
+
+  WeightSample sample = {};
+  TEST_ASSERT_EQUAL(DECODE_OK,
+                    BookooDriver::decode(packet, sizeof(packet), sample));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 123.45f, sample.weightGrams);
+}
+
+void test_bookoo_short_packet() {
+  uint8_t packet[BookooDriver::WEIGHT_PACKET_LEN];
+  makeBookooPacket(packet);
+
+  WeightSample sample = {};
+  for (size_t length = 0; length < sizeof(packet); length++) {
+    TEST_ASSERT_EQUAL(DECODE_TOO_SHORT,
+                      BookooDriver::decode(packet, length, sample));
+  }
+  TEST_ASSERT_EQUAL(DECODE_TOO_SHORT,
+                    BookooDriver::decode(nullptr, sizeof(packet), sample));
+}
+
+void test_bookoo_bad_header() {
+  uint8_t packet[BookooDriver::WEIGHT_PACKET_LEN];
+  WeightSample sample = {};
+
+  for (int i = 0; i < 2; i++) {
+    makeBookooPacket(packet);
+    packet[i] ^= 0x40;
+    // valid checksum, so it's the header that gets it rejected
+    packet[19] = xorChecksum(packet, 19);
+    TEST_ASSERT_EQUAL(DECODE_BAD_HEADER,
+                      BookooDriver::decode(packet, sizeof(packet), sample));
+  }
+}
+
+void test_bookoo_bad_checksum() {
+  uint8_t packet[BookooDriver::WEIGHT_PACKET_LEN];
+  WeightSample sample = {};
+
+  makeBookooPacket(packet);
+  packet[19] ^= 0x01;
+  TEST_ASSERT_EQUAL(DECODE_BAD_CHECKSUM,
+                    BookooDriver::decode(packet, sizeof(packet), sample));
+
+  // a flipped weight byte is what the checksum is there for
+  makeBookooPacket(packet);
+  packet[9] ^= 0x10;
+  TEST_ASSERT_EQUAL(DECODE_BAD_CHECKSUM,
+                    BookooDriver::decode(packet, sizeof(packet), sample));
+}
+
+void test_felicita_good_packet() {
+  uint8_t packet[FelicitaDriver::WEIGHT_PACKET_LEN];
+  makeFelicitaPacket(packet);
+
+  WeightSample sample = {};
+  TEST_ASSERT_EQUAL(DECODE_OK,
+                    FelicitaDriver::decode(packet, sizeof(packet), sample));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 123.45f, sample.weightGrams);
+  TEST_ASSERT_EQUAL_UINT32(0, sample.scaleMs);
+
+  makeFelicitaPacket(packet, '-');
+  TEST_ASSERT_EQUAL(DECODE_OK,
+                    FelicitaDriver::decode(packet, sizeof(packet), sample));
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, -123.45f, sample.weightGrams);
+}
+
+void test_felicita_short_packet() {
+  uint8_t packet[FelicitaDriver::WEIGHT_PACKET_LEN];
+  makeFelicitaPacket(packet);
+
+  WeightSample sample = {};
+  for (size_t length = 0; length < sizeof(packet); length++) {
+    TEST_ASSERT_EQUAL(DECODE_TOO_SHORT,
+                      FelicitaDriver::decode(packet, length, sample));
+  }
+  TEST_ASSERT_EQUAL(DECODE_TOO_SHORT,
+                    FelicitaDriver::decode(nullptr, sizeof(packet), sample));
+}
+
+void test_felicita_bad_header() {
+  uint8_t packet[FelicitaDriver::WEIGHT_PACKET_LEN];
+  WeightSample sample = {};
+
+  for (int i = 0; i < 2; i++) {
+    makeFelicitaPacket(packet);
+    packet[i] = 0x00;
+    TEST_ASSERT_EQUAL(DECODE_BAD_HEADER,
+                      FelicitaDriver::decode(packet, sizeof(packet), sample));
+  }
+}
+
+void test_felicita_corrupt_payload() {
+  // no checksum in this protocol, corruption shows up as a payload that
+  // doesn't parse
+  uint8_t packet[FelicitaDriver::WEIGHT_PACKET_LEN];
+  WeightSample sample = {};
+
+  makeFelicitaPacket(packet);
+  packet[5] = 'x';
+  TEST_ASSERT_EQUAL(DECODE_BAD_FORMAT,
+                    FelicitaDriver::decode(packet, sizeof(packet), sample));
+
+  makeFelicitaPacket(packet, '*');
+  TEST_ASSERT_EQUAL(DECODE_BAD_FORMAT,
+                    FelicitaDriver::decode(packet, sizeof(packet), sample));
+}
+
+void test_bookoo_frames() {
+  const uint8_t expected[CMD_COUNT][MAX_COMMAND_FRAME_LEN] = {
+      {0x03, 0x0A, 0x01, 0x00, 0x00, 0x08}, // tare
+      {0x03, 0x0A, 0x04, 0x00, 0x00, 0x0A}, // start timer
+      {0x03, 0x0A, 0x05, 0x00, 0x00, 0x0D}, // stop timer
+      {0x03, 0x0A, 0x06, 0x00, 0x00, 0x0C}, // reset timer
+      {0x03, 0x0A, 0x07, 0x00, 0x00, 0x00}, // start & tare
+      {0x03, 0x0A, 0x02, 0x00, 0x03, 0x08}, // beep
+  };
+
+  for (int cmd = 0; cmd < CMD_COUNT; cmd++)
+    assertFrame(BookooDriver::FRAMES[cmd], expected[cmd], 6);
+}
+
+void test_felicita_frames() {
+  const uint8_t expected[CMD_COUNT] = {'T', 'R', 'S', 'C', 0, 0};
+
+  for (int cmd = 0; cmd < CMD_COUNT; cmd++)
+    assertFrame(FelicitaDriver::FRAMES[cmd], &expected[cmd],
+                expected[cmd] ? 1 : 0);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_bookoo_good_packet);
+  RUN_TEST(test_bookoo_longer_packet);
+  RUN_TEST(test_bookoo_short_packet);
+  RUN_TEST(test_bookoo_bad_header);
+  RUN_TEST(test_bookoo_bad_checksum);
+  RUN_TEST(test_felicita_good_packet);
+  RUN_TEST(test_felicita_short_packet);
+  RUN_TEST(test_felicita_bad_header);
+  RUN_TEST(test_felicita_corrupt_payload);
+  RUN_TEST(test_bookoo_frames);
+  RUN_TEST(test_felicita_frames);
+  return UNITY_END();
+}